@@ -19,8 +19,13 @@
  * You should have received a copy of the GNU General Public License
  * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
  */
+#ifndef BINIO_H
+#define BINIO_H
 #include <fstream>
 #include <string>
+#include "config.h"
+
+void endianflip(void *addr,int n);
 
 void writebeshort(std::ostream &file,short i);
 void writeleshort(std::ostream &file,short i);
@@ -47,3 +52,12 @@ int readgeint(std::istream &file);
 void writeustring(std::ostream &file,std::string s);
 std::string readustring(std::istream &file);
 
+template <typename T> T littleEndian(T x)
+// Converts a number between native and little-endian byte order.
+{
+#ifdef BIGENDIAN
+  endianflip(&x,sizeof(x));
+#endif
+  return x;
+}
+#endif
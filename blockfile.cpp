@@ -0,0 +1,261 @@
+/******************************************************/
+/*                                                    */
+/* blockfile.cpp - files of fixed-size blocks         */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+#include "blockfile.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PREAD
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+BlockFile::BlockFile()
+{
+  mode=STORE_STREAM;
+  fd=-1;
+  map=nullptr;
+  mapSize=0;
+  fileSize=usedSize=0;
+}
+
+BlockFile::~BlockFile()
+{
+  close();
+}
+
+void BlockFile::open(string fileName,int mode,uint64_t reserve,bool keep)
+/* Opens the file, truncating it unless keep is true. In STORE_MMAP mode,
+ * reserve is the largest the file can grow; that much address space is
+ * mapped, but the file is extended only as blocks are used, and the kernel
+ * pages it in and out. If the file can't be mapped, it is read and written
+ * with pread and pwrite, which need no lock, and failing that, as a stream.
+ */
+{
+  uint64_t oldSize=0;
+  close();
+#ifndef HAVE_SYS_MMAN_H
+  if (mode==STORE_MMAP)
+    mode=STORE_PREAD;
+#endif
+#ifndef HAVE_PREAD
+  if (mode==STORE_PREAD)
+    mode=STORE_STREAM;
+#endif
+  this->mode=mode;
+#ifdef HAVE_PREAD
+  if (mode!=STORE_STREAM)
+  {
+    fd=::open(fileName.c_str(),O_RDWR|O_CREAT|(keep?0:O_TRUNC),0644);
+    if (fd<0)
+    {
+      cerr<<"Can't open "<<fileName<<", using stream\n";
+      this->mode=STORE_STREAM;
+    }
+    else
+      oldSize=lseek(fd,0,SEEK_END);
+  }
+#endif
+#ifdef HAVE_SYS_MMAN_H
+  if (this->mode==STORE_MMAP)
+  {
+    mapSize=reserve;
+    map=(char *)mmap(nullptr,mapSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_NORESERVE,fd,0);
+    if (map==MAP_FAILED)
+    {
+      map=nullptr;
+      cerr<<"Can't map "<<fileName<<", using pread\n";
+      this->mode=STORE_PREAD;
+    }
+  }
+#endif
+  if (this->mode==STORE_STREAM)
+  {
+    if (keep)
+      stream.open(fileName,ios::in|ios::out|ios::binary);
+    if (!stream.is_open())
+      stream.open(fileName,ios::in|ios::out|ios::binary|ios::trunc);
+    stream.seekg(0,ios::end);
+    oldSize=stream.tellg();
+  }
+  fileSize=usedSize=oldSize;
+}
+
+void BlockFile::close()
+{
+#ifdef HAVE_SYS_MMAN_H
+  if (map)
+    munmap(map,mapSize);
+#endif
+#ifdef HAVE_PREAD
+  if (fd>=0)
+    ::close(fd);
+#endif
+  map=nullptr;
+  fd=-1;
+  if (stream.is_open())
+    stream.close();
+  fileSize=usedSize=0;
+}
+
+void BlockFile::setUsed(uint64_t end)
+/* The file's size is the end of the farthest block written or addressed,
+ * or its size when it was opened if that is larger, which is kept here
+ * rather than asking the file.
+ */
+{
+  uint64_t used=usedSize;
+  while (used<end && !usedSize.compare_exchange_weak(used,end));
+}
+
+bool BlockFile::grow(uint64_t newSize)
+/* Extends the file from fileSize to newSize bytes. Where it can, it
+ * allocates the disk space, so that a full disk is found here rather
+ * than by SIGBUS when a block is stored in the mapping. Returns true
+ * if it succeeded.
+ */
+{
+#ifdef HAVE_POSIX_FALLOCATE
+  return posix_fallocate(fd,fileSize,newSize-fileSize)==0;
+#elif defined(HAVE_PREAD)
+  return ftruncate(fd,newSize)==0;
+#else
+  return false;
+#endif
+}
+
+char *BlockFile::address(uint64_t offset,size_t len)
+/* Returns the address at which offset is mapped, extending the file
+ * if it doesn't yet contain offset+len bytes. The file is extended
+ * by at least an eighth at a time, so that it isn't grown for every
+ * new block. Only for STORE_MMAP.
+ */
+{
+  uint64_t end=offset+len,newSize;
+  assert(mode==STORE_MMAP);
+#ifdef HAVE_SYS_MMAN_H
+  if (end>fileSize.load(memory_order_acquire))
+  {
+    growMutex.lock();
+    if (end>fileSize)
+    {
+      newSize=fileSize+fileSize/8;
+      if (newSize<end)
+	newSize=end;
+      if (newSize>mapSize)
+	newSize=mapSize;
+      if (end>mapSize || !grow(newSize))
+      {
+	cerr<<"Can't extend temporary file to "<<end<<" bytes\n";
+	growMutex.unlock();
+	throw -1;
+      }
+      fileSize.store(newSize,memory_order_release);
+    }
+    growMutex.unlock();
+  }
+#endif
+  setUsed(end);
+  return map+offset;
+}
+
+void BlockFile::readBlock(uint64_t offset,char *buf,size_t len)
+/* Reads len bytes at offset. Any part past the end of the file is
+ * zeros. For STORE_PREAD and STORE_STREAM; in STORE_PREAD mode,
+ * many threads can read and write the file at once.
+ */
+{
+  size_t done=0;
+  assert(mode!=STORE_MMAP);
+#ifdef HAVE_PREAD
+  ssize_t n=1;
+  if (mode==STORE_PREAD)
+    while (done<len && n>0)
+    {
+      n=pread(fd,buf+done,len-done,offset+done);
+      if (n>0)
+	done+=n;
+      if (n<0 && errno==EINTR)
+	n=1;
+      else if (n<0)
+      {
+	cerr<<"Can't read temporary file at "<<offset<<": "<<strerror(errno)<<endl;
+	throw -1;
+      }
+    }
+  else
+#endif
+  {
+    fileMutex.lock();
+    stream.seekg(offset);
+    stream.read(buf,len);
+    done=stream.gcount();
+    stream.clear();
+    fileMutex.unlock();
+  }
+  if (done<len) // new block past the end of the file
+    memset(buf+done,0,len-done);
+}
+
+void BlockFile::writeBlock(uint64_t offset,const char *buf,size_t len)
+{
+  size_t done=0;
+  assert(mode!=STORE_MMAP);
+#ifdef HAVE_PREAD
+  ssize_t n=1;
+  if (mode==STORE_PREAD)
+  {
+    while (done<len && n>0)
+    {
+      n=pwrite(fd,buf+done,len-done,offset+done);
+      if (n>0)
+	done+=n;
+      if (n<0 && errno==EINTR)
+	n=1;
+      else if (n<0)
+      {
+	cerr<<"Can't write temporary file at "<<offset<<": "<<strerror(errno)<<endl;
+	throw -1;
+      }
+    }
+    if (done<len) // pwrite wrote nothing
+    {
+      cerr<<"Can't write temporary file at "<<offset<<endl;
+      throw -1;
+    }
+  }
+  else
+#endif
+  {
+    fileMutex.lock();
+    stream.seekp(offset);
+    stream.clear();
+    stream.write(buf,len);
+    fileMutex.unlock();
+  }
+  setUsed(offset+len);
+}
@@ -0,0 +1,85 @@
+/******************************************************/
+/*                                                    */
+/* blockfile.h - files of fixed-size blocks           */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOCKFILE_H
+#define BLOCKFILE_H
+#include <string>
+#include <fstream>
+#include <atomic>
+#include <cstdint>
+#include "config.h"
+#include "threads.h"
+
+// Ways of getting blocks into and out of the temporary files
+#define STORE_STREAM 0
+#define STORE_MMAP 1
+#define STORE_PREAD 2
+
+#if defined(HAVE_UNISTD_H) && !defined(_WIN32)
+#define HAVE_PREAD
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && UINTPTR_MAX>0xffffffff
+#define STORE_DEFAULT STORE_MMAP
+#elif defined(HAVE_PREAD)
+#define STORE_DEFAULT STORE_PREAD
+#else
+#define STORE_DEFAULT STORE_STREAM
+#endif
+
+/* Address space reserved for mapping all the temporary files together.
+ * Only the part of it that is in the files uses any RAM or swap.
+ */
+#define MMAP_RESERVE 0x40000000000
+
+class BlockFile
+{
+public:
+  BlockFile();
+  ~BlockFile();
+  void open(std::string fileName,int mode,uint64_t reserve,bool keep=false);
+  void close();
+  int getMode()
+  {
+    return mode;
+  }
+  uint64_t size()
+  {
+    return usedSize;
+  }
+  char *address(uint64_t offset,size_t len);
+  void readBlock(uint64_t offset,char *buf,size_t len);
+  void writeBlock(uint64_t offset,const char *buf,size_t len);
+private:
+  std::fstream stream;
+  std::mutex fileMutex; // lock when reading/writing stream
+  int mode;
+  int fd;
+  char *map;
+  uint64_t mapSize;
+  std::atomic<uint64_t> fileSize; // bytes the file has been extended to
+  std::atomic<uint64_t> usedSize; // bytes that have been addressed or written
+  void setUsed(uint64_t end);
+  bool grow(uint64_t newSize);
+  std::mutex growMutex; // lock when extending the file
+};
+#endif
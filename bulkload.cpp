@@ -0,0 +1,289 @@
+/******************************************************/
+/*                                                    */
+/* bulkload.cpp - build the octree from sorted points */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <thread>
+#include <cstdio>
+#include "bulkload.h"
+#include "octree.h"
+#include "binio.h"
+using namespace std;
+
+bool lessMorton(const MortonPoint &a,const MortonPoint &b)
+/* Points with the same code are sorted by location, so that duplicates
+ * are next to each other.
+ */
+{
+  if (a.code!=b.code)
+    return a.code<b.code;
+  if (a.pnt.location.getx()!=b.pnt.location.getx())
+    return a.pnt.location.getx()<b.pnt.location.getx();
+  if (a.pnt.location.gety()!=b.pnt.location.gety())
+    return a.pnt.location.gety()<b.pnt.location.gety();
+  return a.pnt.location.getz()<b.pnt.location.getz();
+}
+
+bool laterRun(const pair<MortonPoint,int> &a,const pair<MortonPoint,int> &b)
+// For a heap whose top is the least point.
+{
+  return lessMorton(b.first,a.first);
+}
+
+bool inCube(uint64_t code,int depth,uint64_t prefix)
+{
+  return (code>>3*(MORTON_BITS-depth))==prefix;
+}
+
+BulkLoader::BulkLoader(string fileName,int nthreads)
+/* fileName is the start of the names of the run files. A run takes half
+ * of lowRam, leaving the rest for the buffers.
+ */
+{
+  runName=fileName;
+  nThreads=nthreads;
+  if (nThreads<1)
+    nThreads=1;
+  runSize=lowRam/2/sizeof(MortonPoint);
+  if (runSize<65536)
+    runSize=65536;
+  runPos=0;
+}
+
+BulkLoader::~BulkLoader()
+{
+  int i;
+  for (i=0;i<runStreams.size();i++)
+    delete runStreams[i];
+  for (i=0;i<runFiles.size();i++)
+    remove(runFiles[i].c_str());
+}
+
+void BulkLoader::add(const LasPoint &pnt)
+{
+  MortonPoint mp;
+  mp.code=octRoot.mortonCode(pnt.location);
+  mp.pnt=pnt;
+  run.push_back(mp);
+  if (run.size()>=runSize)
+    spillRun();
+}
+
+void BulkLoader::sortRun()
+// Sorts pieces of the run in parallel, then merges them.
+{
+  int i,width,n=nThreads;
+  vector<thread> sorters;
+  vector<size_t> bounds;
+  if (run.size()<65536*n)
+    n=1;
+  for (i=0;i<=n;i++)
+    bounds.push_back(run.size()*i/n);
+  for (i=0;i<n;i++)
+    sorters.push_back(thread([this,&bounds,i]()
+    {
+      sort(run.begin()+bounds[i],run.begin()+bounds[i+1],lessMorton);
+    }));
+  for (i=0;i<n;i++)
+    sorters[i].join();
+  for (width=1;width<n;width*=2)
+    for (i=0;i+width<n;i+=2*width)
+      inplace_merge(run.begin()+bounds[i],run.begin()+bounds[i+width],
+		    run.begin()+bounds[min(i+2*width,n)],lessMorton);
+}
+
+void BulkLoader::spillRun()
+{
+  size_t i;
+  string name=runName+to_string(runFiles.size());
+  ofstream file(name,ios::binary);
+  sortRun();
+  for (i=0;i<run.size();i++)
+  {
+    writelelong(file,run[i].code);
+    run[i].pnt.write(file);
+  }
+  file.close();
+  if (!file.good())
+  {
+    cerr<<"Can't write "<<name<<endl;
+    throw -1;
+  }
+  runFiles.push_back(name);
+  run.clear();
+}
+
+bool BulkLoader::readRun(int n,MortonPoint &mp)
+{
+  mp.code=readlelong(*runStreams[n]);
+  mp.pnt.read(*runStreams[n]);
+  return runStreams[n]->good();
+}
+
+bool BulkLoader::nextPoint(MortonPoint &mp)
+// Merges the run in RAM with the run files.
+{
+  pair<MortonPoint,int> top;
+  bool fromRun=runPos<run.size();
+  if (heap.size() && (!fromRun || lessMorton(heap[0].first,run[runPos])))
+  {
+    pop_heap(heap.begin(),heap.end(),laterRun);
+    mp=heap.back().first;
+    if (readRun(heap.back().second,heap.back().first))
+      push_heap(heap.begin(),heap.end(),laterRun);
+    else
+      heap.pop_back();
+    return true;
+  }
+  if (fromRun)
+    mp=run[runPos++];
+  return fromRun;
+}
+
+const MortonPoint *BulkLoader::peek(size_t n)
+// Returns the nth point after the last one taken, or nullptr if there is none.
+{
+  MortonPoint mp;
+  while (window.size()<=n && nextPoint(mp))
+    window.push_back(mp);
+  return (n<window.size())?&window[n]:nullptr;
+}
+
+void BulkLoader::takeCube(int depth,uint64_t prefix,vector<LasPoint> &pnts)
+/* Takes the points in the cube and appends them to pnts. Of points at
+ * the same location, one is kept and the others are counted as
+ * duplicates, as put does.
+ */
+{
+  const MortonPoint *mp;
+  while ((mp=peek(0)) && inCube(mp->code,depth,prefix))
+  {
+    if (pnts.size() && pnts.back().location==mp->pnt.location)
+    {
+      alreadyInOctree.push_back(mp->pnt.location);
+      pnts.back()=mp->pnt;
+    }
+    else
+      pnts.push_back(mp->pnt);
+    window.pop_front();
+  }
+}
+
+bool BulkLoader::build(int depth,uint64_t prefix,vector<LasPoint> &pending)
+/* Reads the points in the cube at depth whose Morton code begins with
+ * prefix. If they fit in one block, returns true with them in pending,
+ * so that the parent can decide whether it is a block. If not, makes
+ * blocks of the subcubes whose points fit and returns false.
+ */
+{
+  vector<LasPoint> childPoints[8],cubePoints;
+  const MortonPoint *mp;
+  size_t n;
+  int i;
+  bool fits=false;
+  if (depth>0)
+  {
+    /* A cube with few enough points is read at once, without looking at
+     * its subcubes.
+     */
+    for (n=0;n<=QRECORDS && (mp=peek(n)) && inCube(mp->code,depth,prefix);n++);
+    if (n<=RECORDS)
+      fits=true;
+    else if (n<=QRECORDS)
+    {
+      for (i=0;i<n;i++)
+	cubePoints.push_back(window[i].pnt);
+      fits=octStore.fitsBlock(cubePoints);
+    }
+  }
+  if (fits)
+    takeCube(depth,prefix,pending);
+  else if (depth==MORTON_BITS)
+  {
+    /* The cube is too small to divide by Morton code. Make one block,
+     * and put the rest of the points in the usual way, which can split it.
+     */
+    cubePoints.clear(); // may hold a copy of the points from peeking
+    takeCube(depth,prefix,cubePoints);
+    for (n=RECORDS;n<cubePoints.size();n++)
+      overflow.push_back(cubePoints[n]);
+    if (cubePoints.size()>RECORDS)
+      cubePoints.resize(RECORDS);
+    octStore.newLeaf(cubePoints[0].location,depth,cubePoints);
+  }
+  else
+  {
+    for (i=0;i<8;i++)
+      if ((mp=peek(0)) && inCube(mp->code,depth+1,prefix<<3|i) &&
+	  build(depth+1,prefix<<3|i,childPoints[i]) && childPoints[i].size())
+	octStore.newLeaf(childPoints[i][0].location,depth+1,childPoints[i]);
+  }
+  return fits;
+}
+
+size_t BulkLoader::addFile(LasHeader &hdr)
+/* Adds all the points of a file opened with openRead, reading a LAZ file
+ * through LASzip, then closes the file. Returns the number of points added.
+ */
+{
+  vector<LasPoint> batch;
+  size_t i,j,n=0;
+  if (hdr.isZipped())
+    hdr.reopenLaz();
+  for (i=0;i<hdr.numberPoints();i+=batch.size())
+  {
+    batch.clear();
+    if (!hdr.readPoints(i,LAS_BATCH,batch))
+      break;
+    for (j=0;j<batch.size();j++)
+      add(batch[j]);
+    n+=batch.size();
+  }
+  hdr.close();
+  return n;
+}
+
+void BulkLoader::build()
+/* Makes all the blocks. Call from the main thread while no other thread
+ * is putting points.
+ */
+{
+  int i;
+  MortonPoint mp;
+  vector<LasPoint> pending;
+  sortRun();
+  runPos=0;
+  for (i=0;i<runFiles.size();i++)
+  {
+    runStreams.push_back(new ifstream(runFiles[i],ios::binary));
+    if (readRun(i,mp))
+      heap.push_back(make_pair(mp,i));
+  }
+  make_heap(heap.begin(),heap.end(),laterRun);
+  build(0,0,pending);
+  for (i=0;i<overflow.size();i++)
+  {
+    octStore.put(overflow[i]);
+    octStore.disown();
+  }
+  overflow.clear();
+  run.clear();
+  run.shrink_to_fit();
+}
@@ -0,0 +1,75 @@
+/******************************************************/
+/*                                                    */
+/* bulkload.h - build the octree from sorted points   */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BULKLOAD_H
+#define BULKLOAD_H
+#include <vector>
+#include <deque>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include "las.h"
+
+/* Instead of putting points in the octree one at a time, which splits
+ * blocks over and over, the bulk loader sorts them by Morton code and
+ * makes each block once, full, in Morton order. Points are sorted in runs
+ * that fit in RAM; runs after the first are written to files and merged.
+ * A cube becomes a block if its points fit in one and its parent's don't.
+ *
+ * The octree must be sized and the store open. Call add for every point,
+ * or addFile for every file, then build.
+ */
+
+struct MortonPoint
+{
+  uint64_t code;
+  LasPoint pnt;
+};
+
+class BulkLoader
+{
+public:
+  BulkLoader(std::string fileName,int nthreads);
+  ~BulkLoader();
+  void add(const LasPoint &pnt);
+  size_t addFile(LasHeader &hdr);
+  void build();
+private:
+  std::string runName;
+  int nThreads;
+  size_t runSize;
+  std::vector<MortonPoint> run;
+  std::vector<std::string> runFiles;
+  std::vector<std::ifstream *> runStreams;
+  std::vector<std::pair<MortonPoint,int> > heap; // next point of each run file
+  size_t runPos; // in run, which is merged with the files
+  std::deque<MortonPoint> window; // points read ahead of the cube being built
+  std::vector<LasPoint> overflow;
+  void sortRun();
+  void spillRun();
+  bool readRun(int n,MortonPoint &mp);
+  bool nextPoint(MortonPoint &mp);
+  const MortonPoint *peek(size_t n);
+  void takeCube(int depth,uint64_t prefix,std::vector<LasPoint> &pnts);
+  bool build(int depth,uint64_t prefix,std::vector<LasPoint> &pending);
+};
+#endif
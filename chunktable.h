@@ -0,0 +1,89 @@
+/******************************************************/
+/*                                                    */
+/* chunktable.h - arrays that grow without moving     */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHUNKTABLE_H
+#define CHUNKTABLE_H
+#include <atomic>
+#include <cstddef>
+#include <cassert>
+#include "threads.h"
+
+template <typename T,int chunkBits,int maxChunks> class ChunkTable
+/* An array of up to maxChunks<<chunkBits elements, allocated a chunk
+ * at a time. Chunks are never moved or freed until the table is
+ * destroyed, so one thread can look up an element without locking
+ * while another is growing the table. Elements are value-initialized,
+ * so atomic integers and pointers start at 0.
+ */
+{
+public:
+  ChunkTable()
+  {
+    int i;
+    for (i=0;i<maxChunks;i++)
+      chunk[i]=nullptr;
+    n=0;
+  }
+  ~ChunkTable()
+  {
+    int i;
+    for (i=0;i<maxChunks;i++)
+      delete[] chunk[i].load();
+  }
+  T &operator[](size_t i)
+  {
+    return chunk[i>>chunkBits].load(std::memory_order_acquire)[i&mask];
+  }
+  T *find(size_t i)
+  // Returns nullptr if i is past the allocated chunks.
+  {
+    T *c=nullptr;
+    if ((i>>chunkBits)<maxChunks)
+      c=chunk[i>>chunkBits].load(std::memory_order_acquire);
+    return c?c+(i&mask):nullptr;
+  }
+  size_t size()
+  {
+    return n.load(std::memory_order_acquire);
+  }
+  void reserve(size_t s)
+  {
+    size_t i;
+    assert(s<=((size_t)maxChunks<<chunkBits));
+    growMutex.lock();
+    for (i=0;(i<<chunkBits)<s;i++)
+      if (!chunk[i].load(std::memory_order_relaxed))
+	chunk[i].store(new T[(size_t)1<<chunkBits](),std::memory_order_release);
+    growMutex.unlock();
+  }
+  void setSize(size_t s)
+  {
+    reserve(s);
+    n.store(s,std::memory_order_release);
+  }
+private:
+  static const size_t mask=((size_t)1<<chunkBits)-1;
+  std::atomic<T *> chunk[maxChunks];
+  std::atomic<size_t> n;
+  std::mutex growMutex;
+};
+#endif
@@ -110,6 +110,7 @@ GeneralTab::GeneralTab(QWidget *parent):QWidget(parent)
   threadInput=new QLineEdit(this);
   gridLayout=new QGridLayout(this);
   separateClassesCheck=new QCheckBox(tr("Separate classes"),this);
+  keepStoreCheck=new QCheckBox(tr("Keep store for the same files"),this);
   setLayout(gridLayout);
   gridLayout->addWidget(lengthUnitLabel,0,0);
   gridLayout->addWidget(lengthUnitBox,0,1);
@@ -119,6 +120,7 @@ GeneralTab::GeneralTab(QWidget *parent):QWidget(parent)
   gridLayout->addWidget(pointsPerFileLabel,2,0);
   gridLayout->addWidget(pointsPerFileBox,2,1);
   gridLayout->addWidget(separateClassesCheck,3,1);
+  gridLayout->addWidget(keepStoreCheck,4,1);
 }
 
 ClassifyTab::ClassifyTab(QWidget *parent):QWidget(parent)
@@ -161,7 +163,7 @@ ConfigurationDialog::ConfigurationDialog(QWidget *parent):QDialog(parent)
   connect(cancelButton,SIGNAL(clicked()),this,SLOT(reject()));
 }
 
-void ConfigurationDialog::set(double lengthUnit,int threads,int pointsPerFile,bool separateClasses,double tileSize,double maximumSlope,double thickness,double minimumSmoothness)
+void ConfigurationDialog::set(double lengthUnit,int threads,int pointsPerFile,bool separateClasses,bool keepStore,double tileSize,double maximumSlope,double thickness,double minimumSmoothness)
 {
   int i;
   general->lengthUnitBox->clear();
@@ -229,6 +231,7 @@ void ConfigurationDialog::set(double lengthUnit,int threads,int pointsPerFile,bo
   }
   general->threadInput->setText(QString::number(threads));
   general->separateClassesCheck->setCheckState(separateClasses?Qt::Checked:Qt::Unchecked);
+  general->keepStoreCheck->setCheckState(keepStore?Qt::Checked:Qt::Unchecked);
 }
 
 void ConfigurationDialog::checkValid()
@@ -241,6 +244,7 @@ void ConfigurationDialog::accept()
 		  general->threadInput->text().toInt(),
 		  ppf[general->pointsPerFileBox->currentIndex()],
 		  general->separateClassesCheck->checkState()>0,
+		  general->keepStoreCheck->checkState()>0,
 		  ts[classify->tileSizeBox->currentIndex()],
 		  maxsl[classify->maximumSlopeBox->currentIndex()],
 		  thick[classify->thicknessBox->currentIndex()],
@@ -45,7 +45,7 @@ public:
   QComboBox *lengthUnitBox,*pointsPerFileBox;
   QGridLayout *gridLayout;
   QLineEdit *threadInput;
-  QCheckBox *separateClassesCheck;
+  QCheckBox *separateClassesCheck,*keepStoreCheck;
 };
 
 class ClassifyTab: public QWidget
@@ -66,9 +66,9 @@ class ConfigurationDialog: public QDialog
 public:
   ConfigurationDialog(QWidget *parent=nullptr);
 signals:
-  void settingsChanged(double lu,int thr,int ppf,bool sc,double ts,double maxsl,double thick,double minsm);
+  void settingsChanged(double lu,int thr,int ppf,bool sc,bool ks,double ts,double maxsl,double thick,double minsm);
 public slots:
-  void set(double lengthUnit,int threads,int pointsPerFile,bool separateClasses,double tileSize,double maximumSlope,double thickness,double minimumSmoothness);
+  void set(double lengthUnit,int threads,int pointsPerFile,bool separateClasses,bool keepStore,double tileSize,double maximumSlope,double thickness,double minimumSmoothness);
   void checkValid();
   virtual void accept();
 private:
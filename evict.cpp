@@ -0,0 +1,104 @@
+/******************************************************/
+/*                                                    */
+/* evict.cpp - choose buffers to reuse                */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <cassert>
+#include "evict.h"
+using namespace std;
+
+LruEvictor::LruEvictor()
+{
+  int i;
+  nowUsed=0;
+  clockNum=chrono::steady_clock::period::num;
+  clockDen=chrono::steady_clock::period::den;
+  // count()*clockNum/clockDen is in seconds
+  for (i=0;i<3;i++)
+    if (clockDen%5==0)
+      clockDen/=5;
+    else
+      clockNum*=5;
+  for (i=0;i<3;i++)
+    if (clockDen%2==0)
+      clockDen/=2;
+    else
+      clockNum*=2;
+  // count()*clockNum/clockDen is in milliseconds
+}
+
+void LruEvictor::resize(int n)
+{
+  int i;
+  multimap<int64_t,int>::iterator j;
+  nowUsedMutex.lock();
+  if (n<lastUsed.size())
+  {
+    for (j=lastUsedMap.begin();j!=lastUsedMap.end();)
+    {
+      if (j->second>=n)
+	j=lastUsedMap.erase(j);
+      else
+	++j;
+    }
+  }
+  i=lastUsed.size();
+  lastUsed.resize(n);
+  for (;i<n;i++)
+    lastUsed[i]=-1000;
+  nowUsedMutex.unlock();
+}
+
+void LruEvictor::touch(int buf)
+{
+  nowUsedMutex.lock();
+  nowUsed=chrono::steady_clock::now().time_since_epoch().count()*clockNum/clockDen;
+  if (lastUsed[buf]+618<nowUsed)
+  {
+    pair<multimap<int64_t,int>::iterator,multimap<int64_t,int>::iterator> range=lastUsedMap.equal_range(lastUsed[buf]);
+    while (range.first!=range.second && range.first->second!=buf)
+      ++range.first;
+    if (range.first!=range.second)
+      lastUsedMap.erase(range.first);
+    lastUsed[buf]=nowUsed;
+    lastUsedMap.insert(pair<int64_t,int>(lastUsed[buf],buf));
+  }
+  nowUsedMutex.unlock();
+}
+
+int64_t LruEvictor::getLastUsed(int buf)
+{
+  int64_t ret;
+  nowUsedMutex.lock_shared();
+  ret=lastUsed[buf];
+  nowUsedMutex.unlock_shared();
+  return ret;
+}
+
+ClockEvictor::ClockEvictor()
+{
+  int i;
+  for (i=0;i<CLOCK_SHARDS;i++)
+    hand[i].pos=0;
+}
+
+void ClockEvictor::resize(int n)
+{
+  refBit.setSize(n);
+}
@@ -0,0 +1,179 @@
+/******************************************************/
+/*                                                    */
+/* evict.h - choose buffers to reuse                  */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVICT_H
+#define EVICT_H
+#include <map>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include "threads.h"
+#include "chunktable.h"
+
+// Policies for choosing which buffer to reuse
+#define EVICT_LRU 0
+#define EVICT_CLOCK 1
+
+#define CLOCK_SHARDS 16
+#define EVICT_CHUNK_BITS 12
+#define EVICT_MAXCHUNKS 4096 // up to 16 Mi buffers, 512 GiB
+
+class LruEvictor
+/* Least recently used, by the time each buffer was last used, to the
+ * nearest 618 ms. Every use of a buffer takes the same lock, so this
+ * doesn't scale past a few threads.
+ */
+{
+public:
+  LruEvictor();
+  void resize(int n);
+  void touch(int buf);
+  int64_t getLastUsed(int buf);
+  template <typename F> int victim(F usable);
+  template <typename F> std::vector<int> coldest(int n,F want);
+private:
+  std::shared_mutex nowUsedMutex; // lock when updating nowUsed
+  int64_t nowUsed;
+  uint64_t clockNum,clockDen;
+  std::vector<int64_t> lastUsed; // buffer number -> time counter
+  std::multimap<int64_t,int> lastUsedMap; // time counter -> buffer number
+};
+
+class ClockEvictor
+/* Second chance. Using a buffer sets its reference bit without locking.
+ * The buffers are dealt round-robin into shards, each with its own hand,
+ * so that threads looking for buffers at the same time mostly sweep
+ * different shards. A sweep clears the bits it passes and takes the first
+ * usable buffer whose bit was already clear.
+ */
+{
+public:
+  ClockEvictor();
+  void resize(int n);
+  void touch(int buf)
+  {
+    std::atomic<uint8_t> &r=ref(buf);
+    if (!r.load(std::memory_order_relaxed))
+      r.store(1,std::memory_order_relaxed);
+  }
+  bool isReferenced(int buf)
+  {
+    return ref(buf).load(std::memory_order_relaxed);
+  }
+  template <typename F> int victim(int thread,F usable);
+  template <typename F> std::vector<int> coldest(int n,F want);
+private:
+  struct alignas(64) Hand
+  {
+    std::atomic<uint64_t> pos;
+  };
+  ChunkTable<std::atomic<uint8_t>,EVICT_CHUNK_BITS,EVICT_MAXCHUNKS> refBit;
+  Hand hand[CLOCK_SHARDS];
+  std::atomic<uint8_t> &ref(int buf)
+  {
+    return refBit[buf];
+  }
+  int shardSize(int n,int s)
+  {
+    return (n-s+CLOCK_SHARDS-1)/CLOCK_SHARDS;
+  }
+};
+
+template <typename F> int LruEvictor::victim(F usable)
+// Returns the least recently used buffer that usable() accepts, or -1.
+{
+  int i,ret=-1;
+  std::multimap<int64_t,int>::iterator j;
+  nowUsedMutex.lock_shared();
+  for (j=lastUsedMap.begin();ret<0 && j!=lastUsedMap.end();++j)
+    if (usable(j->second))
+      ret=j->second;
+  for (i=0;ret<0 && lastUsedMap.size()==0 && i<lastUsed.size();i++)
+    if (usable(i))
+      ret=i;
+  nowUsedMutex.unlock_shared();
+  return ret;
+}
+
+template <typename F> std::vector<int> LruEvictor::coldest(int n,F want)
+// Returns up to n buffers that want() accepts, least recently used first.
+{
+  std::vector<int> ret;
+  std::multimap<int64_t,int>::iterator j;
+  nowUsedMutex.lock_shared();
+  for (j=lastUsedMap.begin();ret.size()<n && j!=lastUsedMap.end();++j)
+    if (want(j->second))
+      ret.push_back(j->second);
+  nowUsedMutex.unlock_shared();
+  return ret;
+}
+
+template <typename F> int ClockEvictor::victim(int thread,F usable)
+/* Starts with the thread's own shard and moves to the next one after
+ * going twice around a shard without finding a buffer. Returns -1 if
+ * no buffer in any shard is usable.
+ */
+{
+  int i,j,s,sz,buf,n=refBit.size();
+  if (thread<0)
+    thread=0;
+  for (i=0;i<CLOCK_SHARDS;i++)
+  {
+    s=(thread+i)%CLOCK_SHARDS;
+    sz=shardSize(n,s);
+    for (j=0;j<2*sz;j++)
+    {
+      buf=(hand[s].pos++%sz)*CLOCK_SHARDS+s;
+      if (isReferenced(buf))
+	ref(buf).store(0,std::memory_order_relaxed);
+      else if (usable(buf))
+	return buf;
+    }
+  }
+  return -1;
+}
+
+template <typename F> std::vector<int> ClockEvictor::coldest(int n,F want)
+/* Returns up to n buffers that want() accepts and whose reference bits
+ * are clear, the ones the hands will reach first coming first.
+ * Doesn't move the hands or clear any bits.
+ */
+{
+  std::vector<int> ret;
+  int i,s,sz,buf,nb=refBit.size();
+  uint64_t start[CLOCK_SHARDS];
+  for (s=0;s<CLOCK_SHARDS;s++)
+    start[s]=hand[s].pos;
+  for (i=0;ret.size()<n && i*CLOCK_SHARDS<nb;i++)
+    for (s=0;ret.size()<n && s<CLOCK_SHARDS;s++)
+    {
+      sz=shardSize(nb,s);
+      if (i<sz)
+      {
+	buf=((start[s]+i)%sz)*CLOCK_SHARDS+s;
+	if (!isReferenced(buf) && want(buf))
+	  ret.push_back(buf);
+      }
+    }
+  return ret;
+}
+#endif
@@ -253,6 +253,20 @@ Eisenstein Flowsnake::next()
   return e;
 }
 
+vector<Eisenstein> Flowsnake::peek(int n)
+/* Returns up to n tiles that next() will return, without advancing,
+ * so that their blocks can be read before a thread gets to them.
+ */
+{
+  vector<Eisenstein> ret;
+  int i;
+  flowMutex.lock();
+  for (i=counter;i<=stopnum && i<counter+n;i++)
+    ret.push_back(toFlowsnake(i));
+  flowMutex.unlock();
+  return ret;
+}
+
 void Flowsnake::countNonempty()
 {
   flowMutex.lock();
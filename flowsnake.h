@@ -89,6 +89,7 @@ public:
   void setSize(Cube cube,double desiredSpacing);
   void restart();
   Eisenstein next();
+  std::vector<Eisenstein> peek(int n);
   void countNonempty();
   Cylinder cyl(Eisenstein e);
   Eisenstein tileAddress(xy pnt);
@@ -24,6 +24,9 @@
 #include <cstring>
 #include <ctime>
 #include <cstdint>
+#include <sstream>
+#include <iomanip>
+#include <filesystem>
 #include "config.h"
 #include "las.h"
 #include "binio.h"
@@ -31,10 +34,6 @@
 #include "angle.h"
 #include "manygcd.h"
 
-const int MASK_GPSTIME=0x7fa; // GPS time takes 8 bytes
-const int MASK_RGB=    0x5ac; // RGB takes 6 bytes
-const int MASK_NIR=    0x500; // NIR takes 2 bytes
-const int MASK_WAVE=   0x630; // Wave data take 29 bytes
 const short pointLengths[]={20,28,26,34,57,63,30,36,38,59,67};
 const short pointFeatures[]={0x0,0x1,0x2,0x3,0x9,0xb,0x101,0x103,0x107,0x109,0x10f};
 
@@ -208,8 +207,244 @@ void LasPoint::write(ostream &file) const
 #endif
 }
 
+void LasPoint::fromDisk(const DiskPoint &rec)
+// Same as read, but from a record in a block already in memory.
+{
+  location=xyz(littleEndian(rec.x),littleEndian(rec.y),littleEndian(rec.z));
+  intensity=littleEndian(rec.intensity);
+  returnNum=littleEndian(rec.returnNum);
+  nReturns=littleEndian(rec.nReturns);
+  scanDirection=rec.flags&1;
+  edgeLine=(rec.flags>>1)&1;
+  classification=littleEndian(rec.classification);
+  classificationFlags=littleEndian(rec.classificationFlags);
+  scannerChannel=littleEndian(rec.scannerChannel);
+  userData=littleEndian(rec.userData);
+#ifdef WAVEFORM
+  waveIndex=littleEndian(rec.waveIndex);
+#endif
+  pointSource=littleEndian(rec.pointSource);
+  scanAngle=littleEndian(rec.scanAngle);
+  gpsTime=littleEndian(rec.gpsTime);
+  nir=littleEndian(rec.nir);
+  red=littleEndian(rec.red);
+  green=littleEndian(rec.green);
+  blue=littleEndian(rec.blue);
+#ifdef WAVEFORM
+  waveformOffset=littleEndian(rec.waveformOffset);
+  waveformSize=littleEndian(rec.waveformSize);
+  waveformTime=littleEndian(rec.waveformTime);
+  xDir=littleEndian(rec.xDir);
+  yDir=littleEndian(rec.yDir);
+  zDir=littleEndian(rec.zDir);
+#endif
+}
+
+void LasPoint::toDisk(DiskPoint &rec) const
+{
+  rec.x=littleEndian(location.getx());
+  rec.y=littleEndian(location.gety());
+  rec.z=littleEndian(location.getz());
+  rec.intensity=littleEndian<uint16_t>(intensity);
+  rec.returnNum=littleEndian<uint16_t>(returnNum);
+  rec.nReturns=littleEndian<uint16_t>(nReturns);
+  rec.flags=edgeLine*2+scanDirection;
+  rec.classification=littleEndian<uint16_t>(classification);
+  rec.classificationFlags=littleEndian<uint16_t>(classificationFlags);
+  rec.scannerChannel=littleEndian<uint16_t>(scannerChannel);
+  rec.userData=littleEndian<uint16_t>(userData);
+#ifdef WAVEFORM
+  rec.waveIndex=littleEndian<uint16_t>(waveIndex);
+#endif
+  rec.pointSource=littleEndian<uint16_t>(pointSource);
+  rec.scanAngle=littleEndian<int32_t>(scanAngle);
+  rec.gpsTime=littleEndian(gpsTime);
+  rec.nir=littleEndian<uint16_t>(nir);
+  rec.red=littleEndian<uint16_t>(red);
+  rec.green=littleEndian<uint16_t>(green);
+  rec.blue=littleEndian<uint16_t>(blue);
+#ifdef WAVEFORM
+  rec.waveformOffset=littleEndian<uint64_t>(waveformOffset);
+  rec.waveformSize=littleEndian<uint32_t>(waveformSize);
+  rec.waveformTime=littleEndian(waveformTime);
+  rec.xDir=littleEndian(xDir);
+  rec.yDir=littleEndian(yDir);
+  rec.zDir=littleEndian(zDir);
+#endif
+}
+
+bool LasPoint::fitsQuant() const
+// Returns true if the fields other than location fit in a QuantPoint.
+{
+  return returnNum<16 && nReturns<16 && scannerChannel<4 && classificationFlags<16
+	 && classification<256 && userData<256
+#ifdef WAVEFORM
+	 && waveIndex<256
+#endif
+	 ;
+}
+
+void LasPoint::fromQuant(const QuantPoint &rec,const LasScaling &sc,const int32_t base[3])
+{
+  location=sc.unquantize(base[0]+littleEndian(rec.x),base[1]+littleEndian(rec.y),
+			 base[2]+littleEndian(rec.z));
+  gpsTime=littleEndian(rec.gpsTime);
+  scanAngle=littleEndian(rec.scanAngle);
+  intensity=littleEndian(rec.intensity);
+  pointSource=littleEndian(rec.pointSource);
+  nir=littleEndian(rec.nir);
+  red=littleEndian(rec.red);
+  green=littleEndian(rec.green);
+  blue=littleEndian(rec.blue);
+  returnNum=rec.returns&15;
+  nReturns=rec.returns>>4;
+  scanDirection=rec.flags&1;
+  edgeLine=(rec.flags>>1)&1;
+  scannerChannel=(rec.flags>>2)&3;
+  classificationFlags=rec.flags>>4;
+  classification=rec.classification;
+  userData=rec.userData;
+#ifdef WAVEFORM
+  waveIndex=rec.waveIndex;
+  waveformOffset=littleEndian(rec.waveformOffset);
+  waveformSize=littleEndian(rec.waveformSize);
+  waveformTime=littleEndian(rec.waveformTime);
+  xDir=littleEndian(rec.xDir);
+  yDir=littleEndian(rec.yDir);
+  zDir=littleEndian(rec.zDir);
+#endif
+}
+
+void LasPoint::toQuant(QuantPoint &rec,const int32_t q[3],const int32_t base[3]) const
+// q is the quantized location. Call only if fitsQuant().
+{
+  rec.x=littleEndian<uint32_t>((int64_t)q[0]-base[0]);
+  rec.y=littleEndian<uint32_t>((int64_t)q[1]-base[1]);
+  rec.z=littleEndian<uint32_t>((int64_t)q[2]-base[2]);
+  rec.gpsTime=littleEndian(gpsTime);
+  rec.scanAngle=littleEndian<int32_t>(scanAngle);
+  rec.intensity=littleEndian<uint16_t>(intensity);
+  rec.pointSource=littleEndian<uint16_t>(pointSource);
+  rec.nir=littleEndian<uint16_t>(nir);
+  rec.red=littleEndian<uint16_t>(red);
+  rec.green=littleEndian<uint16_t>(green);
+  rec.blue=littleEndian<uint16_t>(blue);
+  rec.returns=returnNum+(nReturns<<4);
+  rec.flags=scanDirection+(edgeLine<<1)+(scannerChannel<<2)+(classificationFlags<<4);
+  rec.classification=classification;
+  rec.userData=userData;
+#ifdef WAVEFORM
+  rec.waveIndex=waveIndex;
+  rec.waveformOffset=littleEndian<uint64_t>(waveformOffset);
+  rec.waveformSize=littleEndian<uint32_t>(waveformSize);
+  rec.waveformTime=littleEndian(waveformTime);
+  rec.xDir=littleEndian(xDir);
+  rec.yDir=littleEndian(yDir);
+  rec.zDir=littleEndian(zDir);
+#endif
+}
+
 const LasPoint noPoint;
 
+LasScaling::LasScaling()
+{
+  xOffset=yOffset=zOffset=xScale=yScale=zScale=0;
+  unit=1;
+}
+
+LasScaling::LasScaling(double xo,double yo,double zo,double xs,double ys,double zs,double u)
+{
+  xOffset=xo;
+  yOffset=yo;
+  zOffset=zo;
+  xScale=xs;
+  yScale=ys;
+  zScale=zs;
+  unit=u;
+}
+
+xyz LasScaling::unquantize(int32_t x,int32_t y,int32_t z) const
+{
+  return xyz(xOffset+xScale*x,yOffset+yScale*y,zOffset+zScale*z)*unit;
+}
+
+size_t LasScaling::unquantize(size_t n,const int32_t *q,double *coord,const double lo[3],const double hi[3]) const
+/* Unquantizes n points at once. q and coord hold all the x, then all the y,
+ * then all the z. Each loop is a multiply-add over an array, which the
+ * compiler can vectorize, and gives the same results as the one-point
+ * unquantize. Returns the number of coordinates not within lo and hi.
+ */
+{
+  size_t i,nOut=0;
+  const double offset[3]={xOffset,yOffset,zOffset};
+  const double scale[3]={xScale,yScale,zScale};
+  int j;
+  for (j=0;j<3;j++)
+  {
+    const int32_t *qj=q+j*n;
+    double *cj=coord+j*n;
+    double off=offset[j],sc=scale[j],low=lo[j],high=hi[j];
+    for (i=0;i<n;i++)
+    {
+      cj[i]=(off+sc*qj[i])*unit;
+      nOut+=(cj[i]<low)|(cj[i]>high);
+    }
+  }
+  return nOut;
+}
+
+bool LasScaling::quantize(xyz pnt,int32_t q[3]) const
+/* Sets q to the integer coordinates of pnt. Returns true only if
+ * unquantizing them gives back exactly pnt.
+ */
+{
+  double x=rint((pnt.getx()/unit-xOffset)/xScale);
+  double y=rint((pnt.gety()/unit-yOffset)/yScale);
+  double z=rint((pnt.getz()/unit-zOffset)/zScale);
+  bool ret=fabs(x)<=INT32_MAX && fabs(y)<=INT32_MAX && fabs(z)<=INT32_MAX;
+  if (ret)
+  {
+    q[0]=x;
+    q[1]=y;
+    q[2]=z;
+    ret=unquantize(q[0],q[1],q[2])==pnt;
+  }
+  return ret;
+}
+
+bool LasScaling::isValid() const
+{
+  return xScale>0 && yScale>0 && zScale>0 && unit>0 && std::isfinite(xOffset+yOffset+zOffset);
+}
+
+void LasScaling::write(ostream &file) const
+{
+  writeledouble(file,xOffset);
+  writeledouble(file,yOffset);
+  writeledouble(file,zOffset);
+  writeledouble(file,xScale);
+  writeledouble(file,yScale);
+  writeledouble(file,zScale);
+  writeledouble(file,unit);
+}
+
+void LasScaling::read(istream &file)
+{
+  xOffset=readledouble(file);
+  yOffset=readledouble(file);
+  zOffset=readledouble(file);
+  xScale=readledouble(file);
+  yScale=readledouble(file);
+  zScale=readledouble(file);
+  unit=readledouble(file);
+}
+
+bool operator==(const LasScaling &l,const LasScaling &r)
+{
+  return l.xOffset==r.xOffset && l.yOffset==r.yOffset && l.zOffset==r.zOffset &&
+	 l.xScale==r.xScale && l.yScale==r.yScale && l.zScale==r.zScale && l.unit==r.unit;
+}
+
 string read16(istream &file)
 {
   char buf[24];
@@ -280,6 +515,7 @@ string VariableLengthRecord::getData()
 LasHeader::LasHeader()
 {
   lasfile=nullptr;
+  laz=nullptr;
   versionMajor=versionMinor=0;
   unit=1;
   zipFlag=lasOpened=false;
@@ -408,8 +644,7 @@ void LasHeader::openRead(string fileName)
       versionMajor=versionMinor=nPoints[0]=0;
     /* Recognize a LASzip file. There's an extra header between the header
      * (headerSize=375, in format 1.4) and the start of points (pointOffset=469),
-     * starting "\0\0laszip". If so, the file must be decompressed and the
-     * decompressed file read and deleted.
+     * starting "\0\0laszip". If so, the points must be read through LASzip.
      */
     zipFlag=lasOpened=false;
     if (pointOffset>=headerSize+8)
@@ -514,26 +749,22 @@ void LasHeader::openWrite(string fileName,int sysId)
 }
 
 void LasHeader::reopenLaz()
-/* The file has been opened and found to be a LAZ file. Close the file,
- * decompress it to a LAS file, and open the LAS file. If compiled without
- * LASzip, this does nothing.
+/* The file has been opened and found to be a LAZ file. Open a LASzip
+ * reader on it, through which readPoints decompresses the points as it
+ * reads them, without writing a LAS file. If compiled without LASzip,
+ * this does nothing.
  */
 {
 #ifdef LASzip_FOUND
+  laszip_header *header;
   assert(reading);
   assert(zipFlag);
-  assert(!lasOpened);
-  assert(lasfile);
-  close();
-  lasname=tempName(filename);
-  laszipCompex(filename,lasname,false);
-  lasfile=new fstream(lasname,ios::binary|ios::in);
-  lasOpened=zipFlag=true; // close cleared them
-  // pointOffset differs between LAS and LAZ and must be reread.
-  lasfile->seekg(0x60,ios_base::beg);
-  pointOffset=readleint(*lasfile);
-  nVariableLength=readleint(*lasfile);
-  pointFormat=lasfile->get();
+  assert(!laz);
+  laz=openLaz(filename);
+  lazNext=0;
+  // The point format in a LAZ file has the compression bits set.
+  if (laz && !laszip_get_header_pointer(laz,&header))
+    pointFormat=header->point_data_format;
 #endif
 }
 
@@ -600,6 +831,25 @@ bool LasHeader::isValid()
 	 (headerSize>0xe3 || pointFormat<6);
 }
 
+string LasHeader::fingerprint()
+/* Identifies the file well enough that a store saved from it is reused
+ * only if the file hasn't changed: its name, size, and modification time,
+ * and the GUID, number of points, and bounds in its header.
+ */
+{
+  error_code ec;
+  uintmax_t size=filesystem::file_size(filename,ec);
+  filesystem::file_time_type mtime=filesystem::last_write_time(filename,ec);
+  ostringstream ret;
+  int i;
+  ret<<filename<<' '<<size<<' '<<mtime.time_since_epoch().count()<<' '<<numberPoints()<<' ';
+  ret<<hex<<setfill('0')<<setw(8)<<guid1<<'-'<<setw(4)<<guid2<<'-'<<setw(4)<<guid3<<'-';
+  for (i=0;i<8;i++)
+    ret<<setw(2)<<(guid4[i]&255);
+  ret<<hexfloat<<' '<<minX<<' '<<minY<<' '<<minZ<<' '<<maxX<<' '<<maxY<<' '<<maxZ;
+  return ret.str();
+}
+
 bool LasHeader::isZipped()
 {
   return zipFlag;
@@ -686,6 +936,8 @@ void LasHeader::close()
 {
   delete(lasfile);
   lasfile=nullptr;
+  closeLaz(laz);
+  laz=nullptr;
 #ifdef LASzip_FOUND
   if (lasOpened && !reading)
     laszipCompex(lasname,filename,true);
@@ -732,91 +984,355 @@ int LasHeader::getPointFormat()
   return pointFormat;
 }
 
-LasPoint LasHeader::readPoint(size_t num)
+template <typename T> T takeLittle(const char *&rec)
+// Reads a little-endian number from rec and advances past it.
 {
-  LasPoint ret;
-  int xInt,yInt,zInt;
+  T x;
+  memcpy(&x,rec,sizeof(x));
+  rec+=sizeof(x);
+  return littleEndian(x);
+}
+
+template <int format> void LasHeader::decodeRecords(const char *rec,size_t n,LasPoint *pnts,int32_t *q)
+/* Decodes n point records of one format, which has been read into memory,
+ * into pnts, except that the integer coordinates are put in q, all the x,
+ * then all the y, then all the z, to be scaled together. Since format is
+ * a constant, the tests of which fields are present are done once, when
+ * compiling.
+ */
+{
+  const int features=1<<format;
+  size_t i;
   int temp;
-  lasfile->seekg(num*pointLength+pointOffset,ios_base::beg);
-  xInt=readleint(*lasfile);
-  yInt=readleint(*lasfile);
-  zInt=readleint(*lasfile);
-  ret.intensity=readleshort(*lasfile);
-  //if (xInt==0 && yInt==0 && zInt==0)
-    //cout<<"xyz0\n";
-  if (pointFormat<6)
+  const char *r;
+  for (i=0;i<n;i++,rec+=pointLength)
+  {
+    LasPoint &ret=pnts[i];
+    r=rec;
+    q[i]=takeLittle<int32_t>(r);
+    q[i+n]=takeLittle<int32_t>(r);
+    q[i+2*n]=takeLittle<int32_t>(r);
+    ret.intensity=takeLittle<uint16_t>(r);
+    if (format<6)
+    {
+      temp=(unsigned char)*r++;
+      ret.returnNum=temp&7;
+      ret.nReturns=(temp>>3)&7;
+      ret.scanDirection=(temp>>6)&1;
+      ret.edgeLine=(temp>>7)&1;
+      ret.classification=(unsigned char)*r++;
+      ret.classificationFlags=(ret.classification>>5)&7;
+      ret.classification&=31;
+      ret.scanAngle=degtobin((signed char)*r++);
+      ret.userData=(unsigned char)*r++;
+      ret.pointSource=takeLittle<uint16_t>(r);
+    }
+    else // formats 6 through 10
+    {
+      temp=(unsigned char)*r++;
+      ret.returnNum=temp&15;
+      ret.nReturns=(temp>>4)&15;
+      temp=(unsigned char)*r++;
+      ret.classificationFlags=temp&15;
+      ret.scannerChannel=(temp>>4)&3;
+      ret.scanDirection=(temp>>6)&1;
+      ret.edgeLine=(temp>>7)&1;
+      ret.classification=(unsigned char)*r++;
+      ret.userData=(unsigned char)*r++;
+      ret.scanAngle=degtobin(takeLittle<int16_t>(r)*0.006);
+      ret.pointSource=takeLittle<uint16_t>(r);
+    }
+    if (features&MASK_GPSTIME) // 10-5, 4, 3, or 1
+      ret.gpsTime=takeLittle<double>(r);
+    if (features&MASK_RGB) // 10, 8, 7, 5, 3, or 2
+    {
+      ret.red=takeLittle<uint16_t>(r);
+      ret.green=takeLittle<uint16_t>(r);
+      ret.blue=takeLittle<uint16_t>(r);
+    }
+    if (features&MASK_NIR) // 10 or 8
+      ret.nir=takeLittle<uint16_t>(r);
+#ifdef WAVEFORM
+    if (features&MASK_WAVE) // 10, 9, 5 or 4
+    {
+      ret.waveIndex=(unsigned char)*r++;
+      ret.waveformOffset=takeLittle<uint64_t>(r);
+      ret.waveformSize=takeLittle<uint32_t>(r);
+      ret.waveformTime=takeLittle<float>(r);
+      ret.xDir=takeLittle<float>(r);
+      ret.yDir=takeLittle<float>(r);
+      ret.zDir=takeLittle<float>(r);
+    }
+#endif
+  }
+}
+
+void LasHeader::placePoints(LasPoint *pnts,size_t n,const int32_t *q)
+/* Sets the locations of n points from their integer coordinates,
+ * all the x, then all the y, then all the z.
+ */
+{
+  static thread_local vector<double> coords;
+  size_t i,nOut;
+  double lo[3]={minX*unit,minY*unit,minZ*unit};
+  double hi[3]={maxX*unit,maxY*unit,maxZ*unit};
+  coords.resize(3*n);
+  nOut=getScaling().unquantize(n,q,&coords[0],lo,hi);
+  if (nOut)
+    cerr<<nOut<<" coordinates out of range\n";
+  for (i=0;i<n;i++)
+    pnts[i].location=xyz(coords[i],coords[i+n],coords[i+2*n]);
+}
+
+size_t LasHeader::readPoints(istream &file,size_t start,size_t n,vector<LasPoint> &pnts)
+/* Reads n points (fewer if the file ends first) starting with number start
+ * with one read, decodes them, and appends them to pnts. Returns the number
+ * of points read. file is either lasfile or a PointReader's own stream on
+ * the same file, so that several threads can read one file at once; it
+ * does not count the points read.
+ */
+{
+  static thread_local vector<char> recBytes;
+  static thread_local vector<int32_t> quant;
+  size_t oldSize=pnts.size();
+  if (start>=numberPoints())
+    return 0;
+  if (n>numberPoints()-start)
+    n=numberPoints()-start;
+  recBytes.resize(n*pointLength);
+  quant.resize(3*n);
+  file.seekg(start*pointLength+pointOffset,ios_base::beg);
+  file.read(&recBytes[0],n*pointLength);
+  if (!file.good())
+    throw -1;
+  pnts.resize(oldSize+n);
+  switch (pointFormat)
   {
-    temp=lasfile->get();
-    ret.returnNum=temp&7;
-    ret.nReturns=(temp>>3)&7;
-    ret.scanDirection=(temp>>6)&1;
-    ret.edgeLine=(temp>>7)&1;
-    ret.classification=(unsigned char)lasfile->get();
-    ret.classificationFlags=(ret.classification>>5)&7;
-    ret.classification&=31;
-    ret.scanAngle=degtobin((signed char)lasfile->get());
-    ret.userData=(unsigned char)lasfile->get();
-    ret.pointSource=readleshort(*lasfile);
+    case 0:
+      decodeRecords<0>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    case 1:
+      decodeRecords<1>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    case 2:
+      decodeRecords<2>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    case 3:
+      decodeRecords<3>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    case 4:
+      decodeRecords<4>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    case 5:
+      decodeRecords<5>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    case 6:
+      decodeRecords<6>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    case 7:
+      decodeRecords<7>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    case 8:
+      decodeRecords<8>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    case 9:
+      decodeRecords<9>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    case 10:
+      decodeRecords<10>(&recBytes[0],n,&pnts[oldSize],&quant[0]);
+      break;
+    default:
+      pnts.resize(oldSize);
+      throw -1;
   }
-  else // formats 6 through 10
+  placePoints(&pnts[oldSize],n,&quant[0]);
+  return n;
+}
+
+#ifdef LASzip_FOUND
+void fromLaszip(const laszip_point &lp,LasPoint &ret,int format)
+// Like decodeRecords, but from a point decompressed by LASzip.
+{
+  ret.intensity=lp.intensity;
+  ret.scanDirection=lp.scan_direction_flag;
+  ret.edgeLine=lp.edge_of_flight_line;
+  ret.userData=lp.user_data;
+  ret.pointSource=lp.point_source_ID;
+  if (format<6)
   {
-    temp=lasfile->get();
-    ret.returnNum=temp&15;
-    ret.nReturns=(temp>>4)&15;
-    temp=lasfile->get();
-    ret.classificationFlags=temp&15;
-    ret.scannerChannel=(temp>>4)&3;
-    ret.scanDirection=(temp>>6)&1;
-    ret.edgeLine=(temp>>7)&1;
-    ret.classification=(unsigned char)lasfile->get();
-    ret.userData=(unsigned char)lasfile->get();
-    ret.scanAngle=degtobin(readleshort(*lasfile)*0.006);
-    ret.pointSource=readleshort(*lasfile);
+    ret.returnNum=lp.return_number;
+    ret.nReturns=lp.number_of_returns;
+    ret.classification=lp.classification;
+    ret.classificationFlags=lp.synthetic_flag|lp.keypoint_flag<<1|lp.withheld_flag<<2;
+    ret.scanAngle=degtobin(lp.scan_angle_rank);
   }
-  if ((1<<pointFormat)&MASK_GPSTIME) // 10-5, 4, 3, or 1
-    ret.gpsTime=readledouble(*lasfile);
-  if ((1<<pointFormat)&MASK_RGB) // 10, 8, 7, 5, 3, or 2
+  else
   {
-    ret.red=readleshort(*lasfile);
-    ret.green=readleshort(*lasfile);
-    ret.blue=readleshort(*lasfile);
+    ret.returnNum=lp.extended_return_number;
+    ret.nReturns=lp.extended_number_of_returns;
+    ret.classification=lp.extended_classification;
+    ret.classificationFlags=lp.extended_classification_flags;
+    ret.scannerChannel=lp.extended_scanner_channel;
+    ret.scanAngle=degtobin(lp.extended_scan_angle*0.006);
   }
-  if ((1<<pointFormat)&MASK_NIR) // 10 or 8
-    ret.nir=readleshort(*lasfile);
-  if ((1<<pointFormat)&MASK_WAVE) // 10, 9, 5 or 4
+  if ((1<<format)&MASK_GPSTIME)
+    ret.gpsTime=lp.gps_time;
+  if ((1<<format)&MASK_RGB)
+  {
+    ret.red=lp.rgb[0];
+    ret.green=lp.rgb[1];
+    ret.blue=lp.rgb[2];
+  }
+  if ((1<<format)&MASK_NIR)
+    ret.nir=lp.rgb[3];
 #ifdef WAVEFORM
+  if ((1<<format)&MASK_WAVE)
   {
-    ret.waveIndex=(unsigned char)lasfile->get();
-    ret.waveformOffset=readlelong(*lasfile);
-    ret.waveformSize=readleint(*lasfile);
-    ret.waveformTime=readlefloat(*lasfile);
-    ret.xDir=readlefloat(*lasfile);
-    ret.yDir=readlefloat(*lasfile);
-    ret.zDir=readlefloat(*lasfile);
+    const char *wave=(const char *)lp.wave_packet;
+    ret.waveIndex=(unsigned char)*wave++;
+    ret.waveformOffset=takeLittle<uint64_t>(wave);
+    ret.waveformSize=takeLittle<uint32_t>(wave);
+    ret.waveformTime=takeLittle<float>(wave);
+    ret.xDir=takeLittle<float>(wave);
+    ret.yDir=takeLittle<float>(wave);
+    ret.zDir=takeLittle<float>(wave);
   }
+#endif
+}
+#endif
+
+void *LasHeader::openLaz(string fileName)
+// Returns a LASzip reader on the file, or nullptr if it can't be opened.
+{
+#ifdef LASzip_FOUND
+  laszip_POINTER reader=nullptr;
+  laszip_BOOL compressed=false;
+  if (laszip_create(&reader))
+    return nullptr;
+  if (laszip_open_reader(reader,fileName.c_str(),&compressed))
+  {
+    laszipError(reader);
+    laszip_destroy(reader);
+    return nullptr;
+  }
+  return reader;
 #else
+  return nullptr;
+#endif
+}
+
+void LasHeader::closeLaz(void *reader)
+{
+#ifdef LASzip_FOUND
+  if (reader)
   {
-    lasfile->get();
-    readlelong(*lasfile);
-    readleint(*lasfile);
-    readlefloat(*lasfile);
-    readlefloat(*lasfile);
-    readlefloat(*lasfile);
-    readlefloat(*lasfile);
+    laszip_close_reader(reader);
+    laszip_destroy(reader);
   }
 #endif
-  ret.location=xyz(xOffset+xScale*xInt,yOffset+yScale*yInt,zOffset+zScale*zInt)*unit;
-  if (ret.location.getx()>maxX*unit || ret.location.getx()<minX*unit ||
-      ret.location.gety()>maxY*unit || ret.location.gety()<minY*unit ||
-      ret.location.getz()>maxZ*unit || ret.location.getz()<minZ*unit)
+}
+
+size_t LasHeader::readLazPoints(void *reader,size_t &next,size_t start,size_t n,vector<LasPoint> &pnts)
+/* Reads n points starting with number start from a LAZ file through
+ * reader, whose next point is next. Decompressing from the start of
+ * the range is done only if it isn't where the last read left off;
+ * LASzip seeks to the chunk containing start with the chunk table.
+ */
+{
+#ifdef LASzip_FOUND
+  static thread_local vector<int32_t> quant;
+  size_t i,oldSize=pnts.size();
+  laszip_point *lp;
+  if (start>=numberPoints())
+    return 0;
+  if (n>numberPoints()-start)
+    n=numberPoints()-start;
+  if (!reader || laszip_get_point_pointer(reader,&lp))
+    throw -1;
+  if (start!=next && laszip_seek_point(reader,start))
   {
-    cerr<<"Point out of range\n";
-    //ret.location=nanxyz;
+    laszipError(reader);
+    throw -1;
   }
-  if (!lasfile->good())
+  next=start;
+  quant.resize(3*n);
+  pnts.resize(oldSize+n);
+  for (i=0;i<n;i++)
+  {
+    if (laszip_read_point(reader))
+    {
+      laszipError(reader);
+      pnts.resize(oldSize+i);
+      throw -1;
+    }
+    next++;
+    quant[i]=lp->X;
+    quant[i+n]=lp->Y;
+    quant[i+2*n]=lp->Z;
+    fromLaszip(*lp,pnts[oldSize+i],pointFormat);
+  }
+  placePoints(&pnts[oldSize],n,&quant[0]);
+  return n;
+#else
+  throw -1;
+#endif
+}
+
+size_t LasHeader::readPoints(size_t start,size_t n,vector<LasPoint> &pnts)
+/* Throws if the file is compressed and no LASzip reader is open on it,
+ * rather than decoding the compressed bytes as points.
+ */
+{
+  if (laz)
+    n=readLazPoints(laz,lazNext,start,n,pnts);
+  else if (zipFlag)
+  {
+    cerr<<"Can't decompress "<<filename<<'\n';
     throw -1;
-  nReadPoints++;
-  return ret;
+  }
+  else
+    n=readPoints(*lasfile,start,n,pnts);
+  nReadPoints+=n;
+  return n;
+}
+
+PointReader::PointReader(LasHeader &hdr):header(hdr)
+{
+  laz=nullptr;
+  lazNext=0;
+  if (hdr.isZipped())
+  {
+    laz=LasHeader::openLaz(hdr.getFileName());
+    if (!laz)
+    {
+      cerr<<"Can't decompress "<<hdr.getFileName()<<'\n';
+      throw -1;
+    }
+  }
+  else
+    file.open(hdr.getFileName(),ios::binary);
+}
+
+PointReader::~PointReader()
+{
+  LasHeader::closeLaz(laz);
+}
+
+size_t PointReader::readPoints(size_t start,size_t n,vector<LasPoint> &pnts)
+// Like LasHeader::readPoints, but doesn't count the points read.
+{
+  if (laz)
+    return header.readLazPoints(laz,lazNext,start,n,pnts);
+  else
+    return header.readPoints(file,start,n,pnts);
+}
+
+LasPoint LasHeader::readPoint(size_t num)
+{
+  vector<LasPoint> pnts;
+  if (!readPoints(num,1,pnts))
+    throw -1;
+  return pnts[0];
 }
 
 void LasHeader::writePoint(const LasPoint &pnt)
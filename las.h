@@ -24,7 +24,10 @@
 #define LAS_H
 #include <string>
 #include <iostream>
+#include <fstream>
 #include <deque>
+#include <vector>
+#include <cstdint>
 #include "config.h"
 #include "point.h"
 
@@ -39,6 +42,15 @@
 #define SI_EXTRACT 2
 #define SI_TEST 3
 
+// Number of points to read at once when reading a file straight through
+#define LAS_BATCH 4096
+
+// Which point formats have which fields; bit n is format n.
+const int MASK_GPSTIME=0x7fa; // GPS time takes 8 bytes
+const int MASK_RGB=    0x5ac; // RGB takes 6 bytes
+const int MASK_NIR=    0x500; // NIR takes 2 bytes
+const int MASK_WAVE=   0x630; // Wave data take 29 bytes
+
 #ifdef LASzip_FOUND
 
 void laszipInit();
@@ -48,6 +60,70 @@ void laszipCompex(std::string inputFileName,std::string outputFileName,bool comp
 
 class OctBlock;
 
+#pragma pack(push,1)
+struct DiskPoint
+/* A point as it is stored in a block of the temporary file, little-endian.
+ * The layout is the same as that written by LasPoint::write.
+ */
+{
+  double x,y,z;
+  uint16_t intensity,returnNum,nReturns;
+  uint8_t flags;
+  uint16_t classification,classificationFlags,scannerChannel,userData;
+#ifdef WAVEFORM
+  uint16_t waveIndex;
+#endif
+  uint16_t pointSource;
+  int32_t scanAngle;
+  double gpsTime;
+  uint16_t nir,red,green,blue;
+#ifdef WAVEFORM
+  uint64_t waveformOffset;
+  uint32_t waveformSize;
+  float waveformTime,xDir,yDir,zDir;
+#endif
+};
+struct QuantPoint
+/* A point in a quantized block of the temporary file, little-endian.
+ * x, y, and z are offsets, in units of the LAS scale, from the lower
+ * corner of the block.
+ */
+{
+  uint32_t x,y,z;
+  double gpsTime;
+  int32_t scanAngle;
+  uint16_t intensity,pointSource,nir,red,green,blue;
+  uint8_t returns; // returnNum | nReturns<<4
+  uint8_t flags; // scanDirection | edgeLine<<1 | scannerChannel<<2 | classificationFlags<<4
+  uint8_t classification,userData;
+#ifdef WAVEFORM
+  uint8_t waveIndex;
+  uint64_t waveformOffset;
+  uint32_t waveformSize;
+  float waveformTime,xDir,yDir,zDir;
+#endif
+};
+#pragma pack(pop)
+
+class LasScaling
+/* The offsets, scales, and unit with which a LAS file stores coordinates
+ * as integers. unquantize computes exactly what LasHeader::readPoint does.
+ */
+{
+public:
+  LasScaling();
+  LasScaling(double xo,double yo,double zo,double xs,double ys,double zs,double u);
+  xyz unquantize(int32_t x,int32_t y,int32_t z) const;
+  size_t unquantize(size_t n,const int32_t *q,double *coord,const double lo[3],const double hi[3]) const;
+  bool quantize(xyz pnt,int32_t q[3]) const;
+  bool isValid() const;
+  void write(std::ostream &file) const;
+  void read(std::istream &file);
+  friend bool operator==(const LasScaling &l,const LasScaling &r);
+private:
+  double xOffset,yOffset,zOffset,xScale,yScale,zScale,unit;
+};
+
 int joinPointFormat(std::vector<int> formats);
 
 class LasPoint
@@ -77,6 +153,11 @@ public:
 //private:
   void read(std::istream &file);
   void write(std::ostream &file) const;
+  void fromDisk(const DiskPoint &rec);
+  void toDisk(DiskPoint &rec) const;
+  bool fitsQuant() const;
+  void fromQuant(const QuantPoint &rec,const LasScaling &sc,const int32_t base[3]);
+  void toQuant(QuantPoint &rec,const int32_t q[3],const int32_t base[3]) const;
   friend class OctBlock;
 };
 
@@ -108,6 +189,8 @@ class LasHeader
 {
 private:
   std::fstream *lasfile;
+  void *laz; // LASzip reader if reading a LAZ file
+  size_t lazNext; // next point laz will read
   std::string filename,lasname;
   unsigned short sourceId,globalEncoding;
   unsigned int guid1;
@@ -132,6 +215,11 @@ private:
   bool lasOpened; // true if lasfile is opened with lasname
   size_t writePos;
   std::string tempName(std::string name);
+  template <int format> void decodeRecords(const char *rec,size_t n,LasPoint *pnts,int32_t *q);
+  void placePoints(LasPoint *pnts,size_t n,const int32_t *q);
+  static void *openLaz(std::string fileName);
+  static void closeLaz(void *reader);
+  size_t readLazPoints(void *reader,size_t &next,size_t start,size_t n,std::vector<LasPoint> &pnts);
 public:
   LasHeader();
   ~LasHeader();
@@ -155,10 +243,15 @@ public:
   {
     return xyz(xOffset*unit,yOffset*unit,zOffset*unit);
   }
+  LasScaling getScaling() const
+  {
+    return LasScaling(xOffset,yOffset,zOffset,xScale,yScale,zScale,unit);
+  }
   std::string getFileName()
   {
     return filename;
   }
+  std::string fingerprint();
   void setUnit(double u)
   {
     unit=u;
@@ -177,13 +270,37 @@ public:
   {
     return nReadPoints;
   }
+  void addReadPoints(size_t n)
+  {
+    nReadPoints+=n;
+  }
   xyz minCorner();
   xyz maxCorner();
   bool inBox(xyz pnt);
   int getVersion();
   int getPointFormat();
   LasPoint readPoint(size_t num);
+  size_t readPoints(size_t start,size_t n,std::vector<LasPoint> &pnts);
+  size_t readPoints(std::istream &file,size_t start,size_t n,std::vector<LasPoint> &pnts);
   void writePoint(const LasPoint &pnt);
+  friend class PointReader;
+};
+
+class PointReader
+/* A thread's own handle on a file being read, so that several threads
+ * can read different ranges of its points at once. A LAZ file gets its
+ * own LASzip reader.
+ */
+{
+public:
+  PointReader(LasHeader &hdr);
+  ~PointReader();
+  size_t readPoints(size_t start,size_t n,std::vector<LasPoint> &pnts);
+private:
+  LasHeader &header;
+  std::ifstream file;
+  void *laz;
+  size_t lazNext;
 };
 
 xyz combineScales(const std::deque<LasHeader> &headers);
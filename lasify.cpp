@@ -69,7 +69,8 @@ int main(int argc, char *argv[])
     nthreads=thread::hardware_concurrency();
   if (nthreads<1)
     nthreads=2;
-  octStore.open("store.oct",nthreads+relprime(nthreads));
+  octStore.open("store.oct",nthreads+relprime(nthreads),STORE_DEFAULT,
+		window.getKeepStore() && ifstream("store.octi").good());
   octStore.resize(8*nthreads+1);
   startThreads(nthreads);
   window.show();
@@ -95,8 +95,8 @@ LasifyWindow::LasifyWindow(QWidget *parent):QMainWindow(parent)
   canvas=new WolkenCanvas(this);
   configDialog=new ConfigurationDialog(this);
   msgBox=new QMessageBox(this);
-  connect(configDialog,SIGNAL(settingsChanged(double,int,int,bool,double,double,double,double)),
-	  this,SLOT(setSettings(double,int,int,bool,double,double,double,double)));
+  connect(configDialog,SIGNAL(settingsChanged(double,int,int,bool,bool,double,double,double,double)),
+	  this,SLOT(setSettings(double,int,int,bool,bool,double,double,double,double)));
   connect(this,SIGNAL(tinSizeChanged()),canvas,SLOT(setSize()));
   connect(this,SIGNAL(lengthUnitChanged(double)),canvas,SLOT(setLengthUnit(double)));
   connect(this,SIGNAL(fileOpened(std::string)),canvas,SLOT(readFileHeader(std::string)));
@@ -252,7 +252,7 @@ void LasifyWindow::readFileProgress(size_t sofar,size_t total)
 
 void LasifyWindow::configure()
 {
-  configDialog->set(lengthUnit,numberThreads,cloudOutput.pointsPerFile,cloudOutput.separateClasses,canvas->tileSize,maxSlope,thickness,minHyperboloidSize);
+  configDialog->set(lengthUnit,numberThreads,cloudOutput.pointsPerFile,cloudOutput.separateClasses,canvas->keepStore,canvas->tileSize,maxSlope,thickness,minHyperboloidSize);
   configDialog->open();
 }
 
@@ -395,6 +395,7 @@ void LasifyWindow::readSettings()
   lengthUnit=1; // convert the file format, not the unit
   cloudOutput.pointsPerFile=settings.value("pointsPerFile",0).toInt();
   cloudOutput.separateClasses=false; // all points are raw
+  canvas->keepStore=settings.value("keepStore",false).toBool();
   canvas->tileSize=1; // irrelevant
   maxSlope=settings.value("maxSlope",1).toDouble();
   thickness=settings.value("thickness",0).toDouble();
@@ -409,17 +410,19 @@ void LasifyWindow::writeSettings()
   settings.setValue("pos",pos());
   settings.setValue("threads",numberThreads);
   settings.setValue("pointsPerFile",cloudOutput.pointsPerFile);
+  settings.setValue("keepStore",canvas->keepStore);
   settings.setValue("maxSlope",maxSlope);
   settings.setValue("thickness",thickness);
   settings.setValue("minimumHyperboloidSize",minHyperboloidSize);
 }
 
-void LasifyWindow::setSettings(double lu,int thr,int ppf,bool sc,double ts,double maxsl,double thick,double minhs)
+void LasifyWindow::setSettings(double lu,int thr,int ppf,bool sc,bool ks,double ts,double maxsl,double thick,double minhs)
 {
   lengthUnit=lu;
   numberThreads=thr;
   cloudOutput.pointsPerFile=ppf;
   cloudOutput.separateClasses=sc;
+  canvas->keepStore=ks;
   canvas->tileSize=ts;
   maxSlope=maxsl;
   thickness=thick;
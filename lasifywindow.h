@@ -44,6 +44,10 @@ public:
   {
     return numberThreads;
   }
+  bool getKeepStore()
+  {
+    return canvas->keepStore;
+  }
   bool conversionBusy();
 signals:
   void tinSizeChanged();
@@ -55,7 +59,7 @@ signals:
   void allPointsCounted();
 public slots:
   void tick();
-  void setSettings(double lu,int thr,int ppf,bool sc,double ts,double maxsl,double thick,double minhs);
+  void setSettings(double lu,int thr,int ppf,bool sc,bool ks,double ts,double maxsl,double thick,double minhs);
   void setUnit(double lu);
   void openFile();
   void disableMenuSplash();
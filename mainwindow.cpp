@@ -93,8 +93,8 @@ MainWindow::MainWindow(QWidget *parent):QMainWindow(parent)
   canvas=new WolkenCanvas(this);
   configDialog=new ConfigurationDialog(this);
   msgBox=new QMessageBox(this);
-  connect(configDialog,SIGNAL(settingsChanged(double,int,int,bool,double,double,double,double)),
-	  this,SLOT(setSettings(double,int,int,bool,double,double,double,double)));
+  connect(configDialog,SIGNAL(settingsChanged(double,int,int,bool,bool,double,double,double,double)),
+	  this,SLOT(setSettings(double,int,int,bool,bool,double,double,double,double)));
   connect(this,SIGNAL(tinSizeChanged()),canvas,SLOT(setSize()));
   connect(this,SIGNAL(lengthUnitChanged(double)),canvas,SLOT(setLengthUnit(double)));
   connect(this,SIGNAL(fileOpened(std::string)),canvas,SLOT(readFileHeader(std::string)));
@@ -259,7 +259,7 @@ void MainWindow::readFileProgress(size_t sofar,size_t total)
 
 void MainWindow::configure()
 {
-  configDialog->set(lengthUnit,numberThreads,cloudOutput.pointsPerFile,cloudOutput.separateClasses,canvas->tileSize,maxSlope,thickness,minHyperboloidSize);
+  configDialog->set(lengthUnit,numberThreads,cloudOutput.pointsPerFile,cloudOutput.separateClasses,canvas->keepStore,canvas->tileSize,maxSlope,thickness,minHyperboloidSize);
   configDialog->open();
 }
 
@@ -404,6 +404,7 @@ void MainWindow::readSettings()
   lengthUnit=settings.value("lengthUnit",1).toDouble();
   cloudOutput.pointsPerFile=settings.value("pointsPerFile",0).toInt();
   cloudOutput.separateClasses=settings.value("separateClasses",true).toBool();
+  canvas->keepStore=settings.value("keepStore",false).toBool();
   canvas->tileSize=settings.value("tileSize",1).toDouble();
   maxSlope=settings.value("maxSlope",1).toDouble();
   thickness=settings.value("thickness",0).toDouble();
@@ -420,18 +421,20 @@ void MainWindow::writeSettings()
   settings.setValue("lengthUnit",lengthUnit);
   settings.setValue("pointsPerFile",cloudOutput.pointsPerFile);
   settings.setValue("separateClasses",cloudOutput.separateClasses);
+  settings.setValue("keepStore",canvas->keepStore);
   settings.setValue("tileSize",canvas->tileSize);
   settings.setValue("maxSlope",maxSlope);
   settings.setValue("thickness",thickness);
   settings.setValue("minimumHyperboloidSize",minHyperboloidSize);
 }
 
-void MainWindow::setSettings(double lu,int thr,int ppf,bool sc,double ts,double maxsl,double thick,double minhs)
+void MainWindow::setSettings(double lu,int thr,int ppf,bool sc,bool ks,double ts,double maxsl,double thick,double minhs)
 {
   lengthUnit=lu;
   numberThreads=thr;
   cloudOutput.pointsPerFile=ppf;
   cloudOutput.separateClasses=sc;
+  canvas->keepStore=ks;
   canvas->tileSize=ts;
   maxSlope=maxsl;
   thickness=thick;
@@ -0,0 +1,234 @@
+/******************************************************/
+/*                                                    */
+/* mortonindex.cpp - linear index of the octree       */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <cmath>
+#include "mortonindex.h"
+using namespace std;
+
+uint64_t spreadBits(uint64_t x)
+// Puts the low 21 bits of x in every third bit.
+{
+  x&=0x1fffff;
+  x=(x|x<<32)&0x1f00000000ffffULL;
+  x=(x|x<<16)&0x1f0000ff0000ffULL;
+  x=(x|x<<8)&0x100f00f00f00f00fULL;
+  x=(x|x<<4)&0x10c30c30c30c30c3ULL;
+  x=(x|x<<2)&0x1249249249249249ULL;
+  return x;
+}
+
+uint64_t compactBits(uint64_t x)
+// Inverse of spreadBits.
+{
+  x&=0x1249249249249249ULL;
+  x=(x|x>>2)&0x10c30c30c30c30c3ULL;
+  x=(x|x>>4)&0x100f00f00f00f00fULL;
+  x=(x|x>>8)&0x1f0000ff0000ffULL;
+  x=(x|x>>16)&0x1f00000000ffffULL;
+  x=(x|x>>32)&0x1fffff;
+  return x;
+}
+
+MortonIndex::MortonIndex()
+{
+  table=newTable(MORTON_MIN_SIZE);
+  nEntries=0;
+  maxDepth=0;
+  side=0;
+}
+
+MortonIndex::~MortonIndex()
+{
+  int i;
+  for (i=0;i<retired.size();i++)
+    freeTable(retired[i]);
+  freeTable(table);
+}
+
+MortonIndex::Table *MortonIndex::newTable(uint64_t size)
+{
+  Table *ret=new Table;
+  ret->mask=size-1;
+  ret->keys=new atomic<uint64_t>[size]();
+  ret->words=new atomic<uintptr_t>[size]();
+  return ret;
+}
+
+void MortonIndex::freeTable(Table *t)
+{
+  delete[] t->keys;
+  delete[] t->words;
+  delete t;
+}
+
+void MortonIndex::setCube(xyz center,double s)
+// Clears the index and sets the root's cube.
+{
+  clear();
+  side=s;
+  corner[0]=center.getx()-side/2;
+  corner[1]=center.gety()-side/2;
+  corner[2]=center.getz()-side/2;
+}
+
+void MortonIndex::clear()
+// Don't call while another thread may be looking up a point.
+{
+  int i;
+  for (i=0;i<retired.size();i++)
+    freeTable(retired[i]);
+  retired.clear();
+  freeTable(table);
+  table=newTable(MORTON_MIN_SIZE);
+  nEntries=0;
+  maxDepth=0;
+}
+
+uint64_t MortonIndex::code(xyz pnt)
+/* Points outside the root cube are clamped to its faces. Rounding may
+ * put a point near a face of a node in the neighboring node; find checks
+ * for that.
+ */
+{
+  double coord[3]={pnt.getx(),pnt.gety(),pnt.getz()};
+  int i;
+  double t;
+  uint64_t ret=0;
+  for (i=0;i<3;i++)
+  {
+    t=floor(ldexp((coord[i]-corner[i])/side,MORTON_BITS));
+    if (!(t>=0))
+      t=0;
+    if (t>=(1<<MORTON_BITS))
+      t=(1<<MORTON_BITS)-1;
+    ret|=spreadBits((uint64_t)t)<<i;
+  }
+  return ret;
+}
+
+uintptr_t MortonIndex::lookup(uint64_t key)
+// Returns 0 if the key isn't in the index.
+{
+  Table *t=table.load(memory_order_acquire);
+  uint64_t i,k;
+  for (i=hash(key)&t->mask;(k=t->keys[i].load(memory_order_acquire));i=(i+1)&t->mask)
+    if (k==key)
+      return t->words[i].load(memory_order_acquire);
+  return 0;
+}
+
+void MortonIndex::insert(Table *t,uint64_t key,uintptr_t word)
+{
+  uint64_t i,k;
+  for (i=hash(key)&t->mask;(k=t->keys[i].load(memory_order_relaxed)) && k!=key;i=(i+1)&t->mask);
+  t->words[i].store(word,memory_order_release);
+  if (!k)
+  {
+    t->keys[i].store(key,memory_order_release);
+    nEntries++;
+  }
+}
+
+void MortonIndex::set(uint64_t key,uintptr_t word)
+/* Call with setBlockMutex locked. When the table gets half
+ * full, it is copied to one twice as big; the old one is kept until the
+ * index is cleared, as a thread may still be probing it.
+ */
+{
+  Table *t=table.load(memory_order_relaxed),*nt;
+  uint64_t i;
+  int d;
+  if ((nEntries+1)*2>t->mask+1)
+  {
+    nt=newTable(2*(t->mask+1));
+    nEntries=0;
+    for (i=0;i<=t->mask;i++)
+      if (t->keys[i].load(memory_order_relaxed))
+	insert(nt,t->keys[i].load(memory_order_relaxed),t->words[i].load(memory_order_relaxed));
+    table.store(nt,memory_order_release);
+    retired.push_back(t);
+    t=nt;
+  }
+  insert(t,key,word);
+  for (d=0;d<MORTON_BITS && key>>3*(d+1);d++); // key>>66 is undefined
+  if (d>maxDepth)
+    maxDepth=d;
+}
+
+bool MortonIndex::contains(uint64_t code,int depth,xyz pnt,Cube &cube)
+/* Checks that pnt is in the node at depth on code's path, with the same
+ * comparisons Octree makes against the centers of its ancestors, and sets
+ * cube to the node's cube.
+ */
+{
+  double coord[3]={pnt.getx(),pnt.gety(),pnt.getz()};
+  double s=ldexp(side,-depth),lo[3];
+  int i;
+  bool ret=true;
+  for (i=0;i<3;i++)
+  {
+    lo[i]=corner[i]+(compactBits(code>>i)>>(MORTON_BITS-depth))*s;
+    ret=ret && coord[i]>=lo[i] && coord[i]<lo[i]+s;
+  }
+  if (ret)
+    cube=Cube(xyz(lo[0]+s/2,lo[1]+s/2,lo[2]+s/2),s);
+  return ret;
+}
+
+bool MortonIndex::find(xyz pnt,uintptr_t &word,Cube &cube)
+/* Sets word to what Octree::sub has for pnt (0 if no block has been
+ * made there) and cube to its cube. Returns false if the index can't
+ * tell, because pnt is outside the root, or too near a face of a node
+ * to be sure which side it's on, or in a node too deep to be indexed;
+ * the caller should then descend the tree.
+ */
+{
+  uint64_t c;
+  uintptr_t w=0,wmid;
+  int lo=0,hi=maxDepth.load(memory_order_acquire),mid;
+  if (!(side>0))
+    return false;
+  c=code(pnt);
+  while (lo<hi)
+  {
+    mid=(lo+hi+1)/2;
+    wmid=lookup(key(c,mid));
+    if (wmid)
+    {
+      lo=mid;
+      w=wmid;
+    }
+    else
+      hi=mid-1;
+  }
+  if (w&1)
+  {
+    word=w;
+    return contains(c,lo,pnt,cube);
+  }
+  else if (lo==MORTON_BITS)
+    return false;
+  else
+  {
+    word=0;
+    return contains(c,lo+1,pnt,cube);
+  }
+}
@@ -0,0 +1,84 @@
+/******************************************************/
+/*                                                    */
+/* mortonindex.h - linear index of the octree         */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MORTONINDEX_H
+#define MORTONINDEX_H
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include "shape.h"
+
+/* A point's Morton code interleaves MORTON_BITS bits of each coordinate,
+ * z y x from most to least significant within each three-bit group, which
+ * is the order of Octree::sub. A node at depth d (the root's children are
+ * at depth 1) is keyed by the top 3d bits of the code with a 1 bit above
+ * them, so that nodes at different depths have different keys.
+ */
+#define MORTON_BITS 21
+#define MORTON_MIN_SIZE 1024
+
+uint64_t spreadBits(uint64_t x);
+uint64_t compactBits(uint64_t x);
+
+class MortonIndex
+/* Maps keys of octree nodes down to depth MORTON_BITS to the words in
+ * their parents' sub arrays: odd for a block, even for an Octree *.
+ * Only the thread holding setBlockMutex adds to it; lookups
+ * need no lock. Since a node's ancestors are all in the index, the node
+ * containing a point is found by binary search on depth.
+ */
+{
+public:
+  MortonIndex();
+  ~MortonIndex();
+  void setCube(xyz center,double side);
+  void clear();
+  static uint64_t key(uint64_t code,int depth)
+  {
+    return ((uint64_t)1<<3*depth)|(code>>3*(MORTON_BITS-depth));
+  }
+  void set(uint64_t key,uintptr_t word);
+  bool find(xyz pnt,uintptr_t &word,Cube &cube);
+private:
+  struct Table
+  {
+    uint64_t mask;
+    std::atomic<uint64_t> *keys;
+    std::atomic<uintptr_t> *words;
+  };
+  std::atomic<Table *> table;
+  std::vector<Table *> retired; // old tables, which readers may still be using
+  uint64_t nEntries;
+  std::atomic<int> maxDepth;
+  double corner[3],side;
+  uint64_t code(xyz pnt);
+  Table *newTable(uint64_t size);
+  void freeTable(Table *t);
+  static uint64_t hash(uint64_t key)
+  {
+    return (key*0x9e3779b97f4a7c15ULL)>>17;
+  }
+  uintptr_t lookup(uint64_t key);
+  void insert(Table *t,uint64_t key,uintptr_t word);
+  bool contains(uint64_t code,int depth,xyz pnt,Cube &cube);
+};
+#endif
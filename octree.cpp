@@ -27,13 +27,43 @@
 #include "octree.h"
 #include "threads.h"
 #include "brevno.h"
+#include "binio.h"
 #include "freeram.h"
 #define DEBUG_STORE 0
-#define DEBUG_LOCK 0
 #define WATCH_BLOCK_START 0
 #define WATCH_BLOCK_END 0
 using namespace std;
 
+static_assert(sizeof(DiskPoint)==LASPOINT_SIZE,"DiskPoint doesn't match LASPOINT_SIZE");
+static_assert(sizeof(QuantPoint)==QPOINT_SIZE,"QuantPoint doesn't match QPOINT_SIZE");
+static_assert(QUANT_HEADER_SIZE+QPOINT_SIZE*QRECORDS<BLOCKSIZE,"QRECORDS is too big");
+static_assert(LASPOINT_SIZE*RECORDS<BLOCKSIZE,"RECORDS is too big");
+
+const int classSize[BLOCK_CLASSES]={SMALL_BLOCKSIZE,BLOCKSIZE};
+// A slot word is the size class in the top byte and the slot number plus 1.
+#define SLOT_CLASS(w) ((int)((w)>>56))
+#define SLOT_NUMBER(w) ((int64_t)((w)&0xffffffffffffff)-1)
+
+static int doubleCapacity(int size)
+{
+  return min(RECORDS,(size-1)/LASPOINT_SIZE);
+}
+
+static int quantCapacity(int size)
+{
+  return min(QRECORDS,(size-1-QUANT_HEADER_SIZE)/QPOINT_SIZE);
+}
+
+#pragma pack(push,1)
+struct QuantHeader
+{
+  int32_t base[3]; // lower corner of the block in units of the scale
+  uint16_t nPoints;
+  uint8_t scaling;
+};
+#pragma pack(pop)
+static_assert(sizeof(QuantHeader)==QUANT_HEADER_SIZE,"QuantHeader doesn't match QUANT_HEADER_SIZE");
+
 Octree octRoot;
 OctStore octStore;
 double lowRam;
@@ -51,162 +81,250 @@ double significand(double x)
 }
 #endif
 
-int64_t band(xyz pnt)
-// Separates the space into bands, which are used for locking cubes.
+/* Cubes are locked by hashing the leaf cube to one of CUBE_LOCK_STRIPES
+ * lock words. A word holds the owner's lock id in the high half and how
+ * many times the owner has locked it in the low half, or 0 if it's free.
+ * Two leaves may share a word, which only means that one waits for the
+ * other. A thread never waits for a second word while holding one, except
+ * to lock again a word it holds, so this can't deadlock.
+ */
+#define CUBE_LOCK_STRIPES 4096
+struct alignas(64) CubeLock
 {
-  return llrint((pnt.getx()+pnt.gety()+pnt.getz())*cubeMutex.size()/
-		octRoot.getSide()+((sqrt(5)-1)/2));
-}
+  atomic<uint64_t> word;
+};
+CubeLock cubeLocks[CUBE_LOCK_STRIPES];
+atomic<uint32_t> nextLockId(1);
+thread_local uint32_t lockId=0;
+thread_local vector<int> heldLocks; // stripes this thread holds
 
-set<int> whichLocks(Cube cube)
+int cubeStripe(Cube cube)
 {
-  set<int> ret;
-  int64_t lo,hi,i;
-  lo=band(cube.corner(0));
-  hi=band(cube.corner(7));
-  if (lo<0)
+  double d[4]={cube.getCenter().getx(),cube.getCenter().gety(),cube.getCenter().getz(),cube.getSide()};
+  uint64_t u,h=0;
+  int i;
+  for (i=0;i<4;i++)
   {
-    i=((-lo-hi)/cubeMutex.size())*cubeMutex.size();
-    lo+=i;
-    hi+=i;
+    memcpy(&u,&d[i],sizeof(u));
+    h=(h^u)*0x9e3779b97f4a7c15ULL;
+    h^=h>>29;
   }
-  for (i=lo;cube.getSide() && i<=hi;i++)
-    ret.insert(i%cubeMutex.size());
-  return ret;
+  return h%CUBE_LOCK_STRIPES;
 }
 
-bool cubeLocked(xyz pnt)
-/* cubeMutex must be locked when calling this.
- * Returns true iff pnt is in a cube locked by another thread.
+bool lockCube(Cube cube)
+/* Returns true if successful. Doesn't wait. A thread may lock a cube
+ * it already holds; unlockCube releases all of them.
  */
 {
-  int t=thisThread();
-  int64_t b=band(pnt);
-  map<int,Cube>::iterator i;
-  bool ret=false;
-  b%=cubeMutex.size();
-  if (b<0)
-    b+=cubeMutex.size();
-  for (i=lockedCubes[b].begin();!ret && i!=lockedCubes[b].end();++i)
-    ret=t!=i->first && i->second.in(pnt);
-  return ret;
+  int s=cubeStripe(cube);
+  uint64_t w,expected=0;
+  if (!lockId)
+    lockId=nextLockId++;
+  w=cubeLocks[s].word.load(memory_order_relaxed);
+  if (w>>32==lockId)
+  {
+    cubeLocks[s].word.store(w+1,memory_order_relaxed);
+    return true;
+  }
+  if (w==0 && cubeLocks[s].word.compare_exchange_strong(expected,(uint64_t)lockId<<32|1,memory_order_acquire))
+  {
+    heldLocks.push_back(s);
+    return true;
+  }
+  return false;
 }
 
-bool cubeReadLocked(xyz pnt)
-/* cubeMutex must be locked when calling this.
- * Returns true iff pnt is in a cube read-locked by another thread.
- */
+void unlockCube()
 {
-  int t=thisThread();
-  int64_t b=band(pnt);
-  map<int,Cube>::iterator i;
-  bool ret=false;
-  b%=cubeMutex.size();
-  if (b<0)
-    b+=cubeMutex.size();
-  for (i=readLockedCubes[b].begin();!ret && i!=readLockedCubes[b].end();++i)
-    ret=t!=i->first && i->second.in(pnt);
-  return ret;
+  int i;
+  for (i=0;i<heldLocks.size();i++)
+    cubeLocks[heldLocks[i]].word.store(0,memory_order_release);
+  heldLocks.clear();
 }
 
-bool lockCube(Cube cube)
-// Returns true if successful.
+PointTally::PointTally()
 {
-  bool ret;
-  int t=thisThread();
-  set<int> lockSet=whichLocks(cube);
-  set<int>::iterator j;
-  for (j=lockSet.begin();j!=lockSet.end();++j)
-    cubeMutex[*j].lock();
-  ret=!(cubeLocked(cube.getCenter()) || cubeReadLocked(cube.getCenter()));
-  if (ret)
+  int i;
+  count=0;
+  low=INFINITY;
+  high=-INFINITY;
+  for (i=0;i<NODE_CLASSES;i++)
+    classes[i]=0;
+}
+
+void PointTally::add(const LasPoint &pnt,int sign)
+{
+  count+=sign;
+  classes[min((int)pnt.classification,NODE_CLASSES-1)]+=sign;
+  if (sign>0 && pnt.location.elev()<low)
+    low=pnt.location.elev();
+  if (sign>0 && pnt.location.elev()>high)
+    high=pnt.location.elev();
+}
+
+NodeStats::NodeStats()
+{
+  clear();
+}
+
+void NodeStats::add(const PointTally &t)
+{
+  int i;
+  double old;
+  changes.fetch_add(1,memory_order_relaxed);
+  if (t.count)
+    count.fetch_add(t.count,memory_order_relaxed);
+  for (i=0;i<NODE_CLASSES;i++)
+    if (t.classes[i])
+      classes[i].fetch_add(t.classes[i],memory_order_relaxed);
+  old=low.load(memory_order_relaxed);
+  while (t.low<old && !low.compare_exchange_weak(old,t.low,memory_order_relaxed));
+  old=high.load(memory_order_relaxed);
+  while (t.high>old && !high.compare_exchange_weak(old,t.high,memory_order_relaxed));
+}
+
+void NodeStats::clear()
+{
+  int i;
+  changes.store(0,memory_order_relaxed);
+  count.store(0,memory_order_relaxed);
+  low.store(INFINITY,memory_order_relaxed);
+  high.store(-INFINITY,memory_order_relaxed);
+  for (i=0;i<NODE_CLASSES;i++)
+    classes[i].store(0,memory_order_relaxed);
+}
+
+void NodeStats::write(ostream &file) const
+{
+  int i;
+  writelelong(file,getCount());
+  writeledouble(file,getLow());
+  writeledouble(file,getHigh());
+  for (i=0;i<NODE_CLASSES;i++)
+    writelelong(file,getClass(i));
+}
+
+void NodeStats::read(istream &file)
+{
+  int i;
+  count.store(readlelong(file),memory_order_relaxed);
+  low.store(readledouble(file),memory_order_relaxed);
+  high.store(readledouble(file),memory_order_relaxed);
+  for (i=0;i<NODE_CLASSES;i++)
+    classes[i].store(readlelong(file),memory_order_relaxed);
+}
+
+LodSample::LodSample()
+{
+  int i;
+  changes=0;
+  for (i=0;i<LOD_SAMPLES;i++)
+    hash[i]=~(uint64_t)0;
+}
+
+uint64_t hashLocation(xyz pnt)
+{
+  double coord[3]={pnt.getx()+0.,pnt.gety()+0.,pnt.getz()+0.}; // -0 is 0
+  uint64_t h=0,x;
+  int i;
+  for (i=0;i<3;i++)
   {
-    if (t>=0)
-      heldCubes[t]=cube;
-    for (j=lockSet.begin();j!=lockSet.end();++j)
-      lockedCubes[*j].insert(pair<int,Cube>(t,cube));
+    memcpy(&x,&coord[i],sizeof(x));
+    h=(h^x)*0x9e3779b97f4a7c15ULL;
+    h^=h>>29;
   }
-  for (j=lockSet.begin();j!=lockSet.end();++j)
-    cubeMutex[*j].unlock();
-  return ret;
+  return h>>1; // never ~0, which marks an empty cell
 }
 
-bool readLockCube(Cube cube)
-// Returns true if successful.
+int lodCell(xyz pnt,xyz ctr,double sd)
+/* Returns the cell of the cube at ctr with side sd that pnt is in: the
+ * octant (bits 5-7), its octant (bits 2-4), and that octant's quadrant
+ * in x and y (bits 0-1), found the same way as descending the tree.
+ */
 {
-  bool ret;
-  int t=thisThread();
-  set<int> lockSet=whichLocks(cube);
-  set<int>::iterator j;
-  for (j=lockSet.begin();j!=lockSet.end();++j)
-    cubeMutex[*j].lock();
-  ret=!cubeLocked(cube.getCenter());
-  if (ret)
+  int i,xbit,ybit,zbit,ret=0;
+  double x=ctr.getx(),y=ctr.gety(),z=ctr.getz();
+  for (i=0;i<3;i++)
   {
-    if (t>=0)
-      heldCubes[t]=cube;
-    for (j=lockSet.begin();j!=lockSet.end();++j)
-      readLockedCubes[*j].insert(pair<int,Cube>(t,cube));
+    xbit=pnt.getx()>=x;
+    ybit=pnt.gety()>=y;
+    zbit=pnt.getz()>=z;
+    if (i<2)
+      ret=ret<<3|zbit*4|ybit*2|xbit;
+    else
+      ret=ret<<2|ybit*2|xbit;
+    x+=(2*xbit-1)*sd/4;
+    y+=(2*ybit-1)*sd/4;
+    z+=(2*zbit-1)*sd/4;
+    sd/=2;
   }
-  for (j=lockSet.begin();j!=lockSet.end();++j)
-    cubeMutex[*j].unlock();
   return ret;
 }
 
-void unlockCube()
+void LodSample::offer(int cell,const LasPoint &pnt)
 {
-  int t=thisThread();
-  set<int> lockSet;
-  set<int>::iterator j;
-  if (t>=0)
-    lockSet=whichLocks(heldCubes[t]);
-  for (j=lockSet.begin();j!=lockSet.end();++j)
-    cubeMutex[*j].lock();
-  for (j=lockSet.begin();j!=lockSet.end();++j)
+  uint64_t h=hashLocation(pnt.location);
+  if (h<hash[cell])
   {
-    lockedCubes[*j].erase(t);
-    readLockedCubes[*j].erase(t);
+    hash[cell]=h;
+    location[cell]=pnt.location;
+    classification[cell]=pnt.classification;
   }
-  if (t>=0)
-    heldCubes[t]=Cube();
-  for (j=lockSet.begin();j!=lockSet.end();++j)
-    cubeMutex[*j].unlock();
 }
 
 Octree::Octree()
 {
-  for (count=0;count<8;count++)
-    sub[count]=0;
-  count=0;
+  int i;
+  for (i=0;i<8;i++)
+    sub[i].store(0,memory_order_relaxed);
+  sample=nullptr;
+  linear=nullptr;
 }
 
 Octree::~Octree()
 {
   clear();
+  delete linear;
 }
 
 void Octree::clear()
+// Don't call while another thread may be looking up a point.
 {
   int i;
+  uintptr_t subi;
   for (i=0;i<8;i++)
   {
-    if (sub[i] && !(sub[i]&1))
-      delete (Octree *)sub[i];
-    sub[i]=0;
+    subi=sub[i].load(memory_order_relaxed);
+    if (subi && !(subi&1))
+      delete (Octree *)subi;
+    sub[i].store(0,memory_order_relaxed);
   }
+  stats.clear();
+  delete sample;
+  sample=nullptr;
+  if (linear)
+    linear->clear();
 }
 
+/* The root looks up a point in the linear index first, which takes a
+ * Morton code and a few hash probes instead of a pointer chase and three
+ * comparisons per level. If the index can't tell, it descends the tree.
+ */
 int64_t Octree::findBlock(xyz pnt)
 // Returns the disk block number that contains pnt, or -1 if none.
 {
   int xbit,ybit,zbit,i;
   uintptr_t subi;
+  Cube c;
+  if (linear && linear->find(pnt,subi,c))
+    return (subi&1)?(int64_t)(subi>>1):-1;
   xbit=pnt.getx()>=center.getx();
   ybit=pnt.gety()>=center.gety();
   zbit=pnt.getz()>=center.getz();
   i=zbit*4+ybit*2+xbit;
   assert(side>0);
-  subi=sub[i];
+  subi=sub[i].load(memory_order_acquire);
   if (subi==0)
     return -1;
   else if (subi&1)
@@ -220,11 +338,14 @@ Cube Octree::findCube(xyz pnt)
 {
   int xbit,ybit,zbit,i;
   uintptr_t subi;
+  Cube c;
+  if (linear && linear->find(pnt,subi,c))
+    return c;
   xbit=pnt.getx()>=center.getx();
   ybit=pnt.gety()>=center.gety();
   zbit=pnt.getz()>=center.getz();
   i=zbit*4+ybit*2+xbit;
-  subi=sub[i];
+  subi=sub[i].load(memory_order_acquire);
   if (subi==0 || (subi&1))
     return cube(i);
   else
@@ -234,35 +355,131 @@ Cube Octree::findCube(xyz pnt)
 vector<int64_t> Octree::findBlocks(const Shape &sh)
 // Find all blocks that intersect the shape.
 {
-  vector<int64_t> ret,part;
-  int i,j;
-  if (sh.intersect(cube()))
-    for (i=0;i<8;i++)
-    {
-      part.clear();
-      if (sub[i]&1 && sh.intersect(cube(i)))
-	part.push_back(sub[i]>>1);
-      if (!(sub[i]&1) && sub[i])
-	part=((Octree *)sub[i])->findBlocks(sh);
-      for (j=0;j<part.size();j++)
-	ret.push_back(part[j]);
-    }
+  vector<int64_t> ret;
+  visitBlocks(sh,[&ret](int64_t block,bool inside){ret.push_back(block);});
   return ret;
 }
 
 void Octree::setBlock(xyz pnt,int64_t blk)
+// Call with setBlockMutex locked.
+{
+  setBlock(pnt,blk,linear,1);
+}
+
+void Octree::setBlock(xyz pnt,int64_t blk,MortonIndex *index,uint64_t key)
+/* key is this node's key in the index. Nodes deeper than the index
+ * goes are left out of it.
+ */
+{
+  int xbit,ybit,zbit,i;
+  uintptr_t subi;
+  xbit=pnt.getx()>=center.getx();
+  ybit=pnt.gety()>=center.gety();
+  zbit=pnt.getz()>=center.getz();
+  i=zbit*4+ybit*2+xbit;
+  if (key>>3*MORTON_BITS)
+    index=nullptr;
+  subi=sub[i].load(memory_order_relaxed);
+  if (subi==0)
+  {
+    sub[i].store(blk*2+1,memory_order_release);
+    if (index)
+      index->set(key<<3|i,blk*2+1);
+  }
+  else if (subi&1)
+    cerr<<"Tried to set block "<<blk<<", point already in block "<<(subi>>1)<<endl;
+  else
+    ((Octree *)subi)->setBlock(pnt,blk,index,key<<3|i);
+}
+
+void Octree::setLeaf(xyz pnt,int64_t blk,int depth)
+/* Puts blk in the cube at depth (1 is the root's subcubes) containing pnt,
+ * making nodes down to it. Used by bulk loading, which makes the blocks
+ * in Morton order. Call with setBlockMutex locked.
+ */
+{
+  setLeaf(pnt,blk,depth,linear,1);
+}
+
+void Octree::setLeaf(xyz pnt,int64_t blk,int depth,MortonIndex *index,uint64_t key)
 {
   int xbit,ybit,zbit,i;
+  uintptr_t subi;
+  Octree *newblk;
   xbit=pnt.getx()>=center.getx();
   ybit=pnt.gety()>=center.gety();
   zbit=pnt.getz()>=center.getz();
   i=zbit*4+ybit*2+xbit;
-  if (sub[i]==0)
-    sub[i]=blk*2+1;
-  else if (sub[i]&1)
-    cerr<<"Tried to set block "<<blk<<", point already in block "<<(sub[i]>>1)<<endl;
+  if (key>>3*MORTON_BITS)
+    index=nullptr;
+  subi=sub[i].load(memory_order_relaxed);
+  if (subi&1)
+    cerr<<"Tried to set block "<<blk<<", point already in block "<<(subi>>1)<<endl;
+  else if (depth<=1)
+  {
+    if (subi)
+      cerr<<"Tried to set block "<<blk<<" in place of a subtree\n";
+    else
+    {
+      sub[i].store(blk*2+1,memory_order_release);
+      if (index)
+	index->set(key<<3|i,blk*2+1);
+    }
+  }
   else
-    ((Octree *)sub[i])->setBlock(pnt,blk);
+  {
+    if (subi==0)
+    {
+      newblk=new Octree;
+      newblk->center=cube(i).getCenter();
+      newblk->side=side/2;
+      subi=(uintptr_t)newblk;
+      sub[i].store(subi,memory_order_release);
+      if (index)
+	index->set(key<<3|i,subi);
+    }
+    ((Octree *)subi)->setLeaf(pnt,blk,depth-1,index,key<<3|i);
+  }
+}
+
+void Octree::addTally(xyz pnt,const PointTally &tally)
+/* Adds tally to the aggregates of the nodes containing pnt, down to its
+ * block. Call while holding the block's cube lock, so that it isn't split.
+ */
+{
+  int xbit,ybit,zbit;
+  uintptr_t subi;
+  stats.add(tally);
+  xbit=pnt.getx()>=center.getx();
+  ybit=pnt.gety()>=center.gety();
+  zbit=pnt.getz()>=center.getz();
+  subi=sub[zbit*4+ybit*2+xbit].load(memory_order_acquire);
+  if (subi && !(subi&1))
+    ((Octree *)subi)->addTally(pnt,tally);
+}
+
+uint64_t Octree::mortonCode(xyz pnt)
+/* Returns the Morton code of pnt to MORTON_BITS levels below the root,
+ * computed with the same comparisons as descending the tree, so that a
+ * point near a face is in the same cube as the tree puts it. MortonIndex
+ * computes codes faster but not always the same.
+ */
+{
+  double x=center.getx(),y=center.gety(),z=center.getz(),s=side;
+  int i,xbit,ybit,zbit;
+  uint64_t ret=0;
+  for (i=0;i<MORTON_BITS;i++)
+  {
+    xbit=pnt.getx()>=x;
+    ybit=pnt.gety()>=y;
+    zbit=pnt.getz()>=z;
+    ret=ret<<3|zbit*4|ybit*2|xbit;
+    x+=(2*xbit-1)*s/4;
+    y+=(2*ybit-1)*s/4;
+    z+=(2*zbit-1)*s/4;
+    s/=2;
+  }
+  return ret;
 }
 
 void Octree::sizeFit(vector<xyz> pnts)
@@ -307,43 +524,65 @@ void Octree::sizeFit(vector<xyz> pnts)
     }
     center=xyz(x+side/2,y+side/2,z+side/2);
   }
+  if (!linear)
+    linear=new MortonIndex;
+  linear->setCube(center,side);
 }
 
-void Octree::split(xyz pnt)
-/* Splits the block containing pnt into eight blocks. The subblock with pnt in it
- * is the same as the original block; the others are set to none.
- * Called from OctStore::split.
+void Octree::split(xyz pnt,const int64_t childBlock[8],const PointTally &tally)
+/* Splits the block containing pnt into eight blocks. Subblock j is
+ * childBlock[j], or none if it is negative; one of them is the original
+ * block. tally is the block's points, which become the new node's
+ * aggregates. Called from OctStore::split.
  */
 {
-  int xbit,ybit,zbit,i;
-  uintptr_t blknum;
+  split(pnt,childBlock,tally,linear,1);
+}
+
+void Octree::split(xyz pnt,const int64_t childBlock[8],const PointTally &tally,MortonIndex *index,uint64_t key)
+/* Lookups don't lock anything. The new node is filled in before it is
+ * published with a release store, and nodes are freed only by clear, so
+ * a reader sees either the old leaf or the whole new node. The child
+ * blocks already hold their points.
+ */
+{
+  int xbit,ybit,zbit,i,j;
+  uintptr_t subi;
   Octree *newblk;
   xbit=pnt.getx()>=center.getx();
   ybit=pnt.gety()>=center.gety();
   zbit=pnt.getz()>=center.getz();
   i=zbit*4+ybit*2+xbit;
-  if (sub[i]==0)
+  if (key>>3*MORTON_BITS)
+    index=nullptr;
+  subi=sub[i].load(memory_order_acquire);
+  if (subi==0)
     cerr<<"Can't split empty block\n";
-  else if (sub[i]&1)
+  else if (subi&1)
   {
     octStore.setBlockMutex.lock();
-    blknum=sub[i];
-    sub[i]=(uintptr_t)(newblk=new Octree);
+    newblk=new Octree;
     newblk->center=xyz(center.getx()+(2*xbit-1)*side/4,
 		       center.gety()+(2*ybit-1)*side/4,
 		       center.getz()+(2*zbit-1)*side/4);
     newblk->side=side/2;
-    for (i=0;i<8;i++)
-      newblk->sub[i]=0;
-    xbit=pnt.getx()>=newblk->center.getx();
-    ybit=pnt.gety()>=newblk->center.gety();
-    zbit=pnt.getz()>=newblk->center.getz();
-    i=zbit*4+ybit*2+xbit;
-    newblk->sub[i]=blknum;
+    newblk->stats.add(tally);
+    for (j=0;j<8;j++)
+      if (childBlock[j]>=0)
+	newblk->sub[j].store(childBlock[j]*2+1,memory_order_relaxed);
+    sub[i].store((uintptr_t)newblk,memory_order_release);
+    /* The blocks go into the index at their new depth before their old
+     * node becomes internal, so that a lookup in between finds them.
+     */
+    for (j=0;j<8;j++)
+      if (childBlock[j]>=0 && index && !((key<<3)>>3*MORTON_BITS))
+	index->set(key<<6|i<<3|j,childBlock[j]*2+1);
+    if (index)
+      index->set(key<<3|i,(uintptr_t)newblk);
     octStore.setBlockMutex.unlock();
   }
   else
-    ((Octree *)sub[i])->split(pnt);
+    ((Octree *)subi)->split(pnt,childBlock,tally,index,key<<3|i);
 }
 
 Cube Octree::cube(int n)
@@ -363,7 +602,7 @@ int Octree::dump(ofstream &file)
   uintptr_t subi;
   for (i=0;i<8;i++)
   {
-    subi=sub[i];
+    subi=sub[i].load(memory_order_acquire);
     if (subi&1)
     {
       totalPoints+=octStore.getBlock(subi>>1)->dump(file,cube(i));
@@ -375,80 +614,280 @@ int Octree::dump(ofstream &file)
   return totalPoints;
 }
 
-void Octree::plot(PostScript &ps)
+void Octree::offerPoints(LodSample &s,xyz ctr,double sd)
+// Offers all the points in the subtree to s, whose cube is at ctr with side sd.
 {
-  int i;
+  int i,j;
   uintptr_t subi;
+  OctBuffer *buf;
   for (i=0;i<8;i++)
   {
-    subi=sub[i];
+    subi=sub[i].load(memory_order_acquire);
     if (subi&1)
     {
-      octStore.getBlock(subi>>1)->plot(ps,cube(i));
+      buf=octStore.getBlock(subi>>1);
+      buf->blockMutex.lock_shared();
+      for (j=0;j<buf->points.size();j++)
+	s.offer(lodCell(buf->points[j].location,ctr,sd),buf->points[j]);
+      buf->blockMutex.unlock_shared();
       octStore.disown();
     }
     else if (subi)
-      ((Octree *)subi)->plot(ps);
+      ((Octree *)subi)->offerPoints(s,ctr,sd);
   }
 }
 
-void Octree::countPoints(unsigned int n)
-// Descends the subtree specified by n, updating count.
+LodSample *Octree::getSample()
+/* Returns the node's sample, remaking it if points have been put in the
+ * subtree since it was made. A child big enough to have a sample gives
+ * its sample; the cells of eight of them make one cell of the parent.
+ * The points of smaller children are read. Call with sampleMutex locked.
+ */
 {
-  int i;
-  uint64_t total=0;
+  int i,j,cell;
   uintptr_t subi;
-  subi=sub[n&7];
-  if ((subi&1)==0 && subi)
-    ((Octree *)subi)->countPoints(n>>3);
+  Octree *child;
+  LodSample *s;
+  uint64_t changes=stats.getChanges();
+  if (sample && sample->changes==changes)
+    return sample;
+  if (!sample)
+    sample=new LodSample;
+  *sample=LodSample();
+  sample->changes=changes;
   for (i=0;i<8;i++)
   {
-    subi=sub[i];
+    subi=sub[i].load(memory_order_acquire);
+    child=(Octree *)subi;
+    if (subi==0 || (subi&1) || child->getCount()<LOD_MIN_POINTS)
+      continue;
+    s=child->getSample();
+    for (j=0;j<LOD_SAMPLES;j++)
+    {
+      cell=i<<5|(j>>5)<<2|((j>>2)&3);
+      if (s->hash[j]<sample->hash[cell])
+      {
+	sample->hash[cell]=s->hash[j];
+	sample->location[cell]=s->location[j];
+	sample->classification[cell]=s->classification[j];
+      }
+    }
+  }
+  for (i=0;i<8;i++)
+  {
+    subi=sub[i].load(memory_order_acquire);
+    child=(Octree *)subi;
     if (subi&1)
-      total+=octStore.getBlock(subi>>1)->countPoints();
-    else if (subi)
-      total+=((Octree *)subi)->count;
+    {
+      OctBuffer *buf=octStore.getBlock(subi>>1);
+      buf->blockMutex.lock_shared();
+      for (j=0;j<buf->points.size();j++)
+	sample->offer(lodCell(buf->points[j].location,center,side),buf->points[j]);
+      buf->blockMutex.unlock_shared();
+      octStore.disown();
+    }
+    else if (subi && child->getCount()<LOD_MIN_POINTS)
+      child->offerPoints(*sample,center,side);
+  }
+  return sample;
+}
+
+void Octree::samplePoints(const Shape &sh,double spacing,vector<LasPoint> &pnts,bool inside)
+/* Appends to pnts the points in sh, using the sample of any node whose
+ * cells are no wider than spacing instead of its blocks. Call with
+ * sampleMutex locked.
+ */
+{
+  int i,j;
+  bool in;
+  uintptr_t subi;
+  LasPoint pnt;
+  LodSample *s;
+  OctBuffer *buf;
+  Cube c;
+  if (getCount()>=LOD_MIN_POINTS && side/8<=spacing)
+  {
+    s=getSample();
+    for (j=0;j<LOD_SAMPLES;j++)
+      if (s->hash[j]!=~(uint64_t)0 && (inside || sh.in(s->location[j])))
+      {
+	pnt.location=s->location[j];
+	pnt.classification=s->classification[j];
+	pnts.push_back(pnt);
+      }
+    return;
+  }
+  for (i=0;i<8;i++)
+  {
+    subi=sub[i].load(memory_order_acquire);
+    if (subi)
+    {
+      in=inside;
+      if (!in)
+      {
+	c=cube(i);
+	if (!sh.intersect(c))
+	  continue;
+	in=sh.in(c);
+      }
+      if (subi&1)
+      {
+	buf=octStore.getBlock(subi>>1);
+	buf->blockMutex.lock_shared();
+	for (j=0;j<buf->points.size();j++)
+	  if (in || sh.in(buf->points[j].location))
+	    pnts.push_back(buf->points[j]);
+	buf->blockMutex.unlock_shared();
+	octStore.disown();
+      }
+      else
+	((Octree *)subi)->samplePoints(sh,spacing,pnts,in);
+    }
+  }
+}
+
+void Octree::save(ostream &file)
+// Writes the octree's shape and block numbers. Only for the root.
+{
+  writeledouble(file,center.getx());
+  writeledouble(file,center.gety());
+  writeledouble(file,center.getz());
+  writeledouble(file,side);
+  saveNode(file);
+}
+
+void Octree::saveNode(ostream &file)
+/* The node's aggregates are followed by its subs, each written as a
+ * little-endian 64-bit number: 0 for none, odd for a block, and 2 for a
+ * subtree, which follows.
+ */
+{
+  int i;
+  uintptr_t subi;
+  stats.write(file);
+  for (i=0;i<8;i++)
+  {
+    subi=sub[i].load(memory_order_acquire);
+    if (subi==0 || (subi&1))
+      writelelong(file,subi);
+    else
+    {
+      writelelong(file,2);
+      ((Octree *)subi)->saveNode(file);
+    }
+  }
+}
+
+void Octree::load(istream &file)
+// Replaces the octree with one written by save, rebuilding the index.
+{
+  double x,y,z;
+  clear();
+  x=readledouble(file);
+  y=readledouble(file);
+  z=readledouble(file);
+  center=xyz(x,y,z);
+  side=readledouble(file);
+  if (!linear)
+    linear=new MortonIndex;
+  linear->setCube(center,side);
+  loadNode(file,linear,1);
+}
+
+void Octree::loadNode(istream &file,MortonIndex *index,uint64_t key)
+{
+  int i;
+  uintptr_t subi;
+  Octree *newblk;
+  if (key>>3*MORTON_BITS)
+    index=nullptr;
+  stats.read(file);
+  for (i=0;i<8 && file.good();i++)
+  {
+    subi=readlelong(file);
+    if (subi==2)
+    {
+      newblk=new Octree;
+      newblk->center=cube(i).getCenter();
+      newblk->side=side/2;
+      newblk->loadNode(file,index,key<<3|i);
+      subi=(uintptr_t)newblk;
+    }
+    sub[i].store(subi,memory_order_release);
+    if (subi && index)
+      index->set(key<<3|i,subi);
   }
-  count=total;
 }
 
 OctBuffer::OctBuffer()
 {
   int i;
-  lastUsed=0;
+  scaling=-1;
   dirty=inTransit=false;
   high=-INFINITY;
   low=INFINITY;
-  points.reserve(RECORDS);
+  points.reserve(QRECORDS);
   for (i=0;i<RECORDS;i++)
     points.emplace_back();
+  keySlots.resize(KEY_SLOTS);
 }
 
-void OctBuffer::write()
+void OctBuffer::encode(char *block,int size)
+/* Encodes the points into a block of size bytes. If all points are
+ * in one LAS scaling, stores them as integer offsets from the block's corner;
+ * otherwise stores the coordinates as doubles.
+ */
 {
-  int i,f=blockNumber%store->nFiles,b=blockNumber/store->nFiles;
+  int i,j,cap;
   int nPoints=0;
-  blockMutex.lock_shared();
-  store->fileMutex[f].lock();
-  logBeginWrite(bufferNumber,blockNumber);
-#if DEBUG_STORE
-  cout<<"Writing block "<<blockNumber<<endl;
-#endif
-  store->file[f].seekp(BLOCKSIZE*b);
-  //cout<<store->file.rdstate()<<' '<<ios::failbit<<endl;
-  store->file[f].clear();
-  for (i=0;i<points.size() && i<RECORDS;i++)
+  bool quant=scaling>=0;
+  vector<array<int32_t,3> > q;
+  int32_t base[3]={INT32_MAX,INT32_MAX,INT32_MAX};
+  static DiskPoint emptyRecord;
+  static once_flag emptyOnce;
+  call_once(emptyOnce,[]{noPoint.toDisk(emptyRecord);});
+  if (quant)
+  {
+    q.resize(points.size());
+    for (i=0;quant && i<points.size();i++)
+    {
+      quant=store->scalings[scaling].quantize(points[i].location,&q[i][0]);
+      for (j=0;j<3;j++)
+	if (q[i][j]<base[j])
+	  base[j]=q[i][j];
+    }
+  }
+  if (quant)
   {
-    points[i].write(store->file[f]);
-    nPoints+=!points[i].isEmpty();
+    QuantHeader *header=(QuantHeader *)block;
+    QuantPoint *records=(QuantPoint *)(block+QUANT_HEADER_SIZE);
+    for (j=0;j<3;j++)
+      header->base[j]=littleEndian(base[j]);
+    header->nPoints=littleEndian<uint16_t>(points.size());
+    header->scaling=scaling;
+    for (i=0;i<points.size();i++)
+      points[i].toQuant(records[i],&q[i][0],base);
+    nPoints=points.size();
+    assert(nPoints<=quantCapacity(size));
+    i=QUANT_HEADER_SIZE+QPOINT_SIZE*points.size();
+    memset(block+i,0,size-1-i);
+    block[size-1]=BLOCK_QUANT;
   }
-  for (;i<RECORDS;i++)
+  else
   {
-    noPoint.write(store->file[f]);
+    DiskPoint *records=(DiskPoint *)block;
+    cap=doubleCapacity(size);
+    assert(points.size()<=cap);
+    for (i=0;i<points.size() && i<cap;i++)
+    {
+      points[i].toDisk(records[i]);
+      nPoints+=!points[i].isEmpty();
+    }
+    for (;i<cap;i++)
+      records[i]=emptyRecord;
+    memset(block+cap*LASPOINT_SIZE,0,size-cap*LASPOINT_SIZE);
+    block[size-1]=BLOCK_DOUBLE;
   }
-  dirty=false;
-  for (i=RECORDS*LASPOINT_SIZE;i<BLOCKSIZE;i++)
-    store->file[f].put(0);
   if ((blockNumber>=WATCH_BLOCK_START && blockNumber<WATCH_BLOCK_END) || watchedBuffers.count(bufferNumber))
   {
     msgMutex.lock();
@@ -456,21 +895,71 @@ void OctBuffer::write()
     watchedBuffers.insert(bufferNumber);
     msgMutex.unlock();
   }
-  logEndWrite(bufferNumber,blockNumber);
-  store->fileMutex[f].unlock();
+}
+
+void OctBuffer::compact(vector<char> &bytes)
+/* Encodes the points with no empty records after them, for keeping in
+ * the RAM tier.
+ */
+{
+  blockMutex.lock_shared();
+  if (scaling>=0)
+    bytes.resize(QUANT_HEADER_SIZE+QPOINT_SIZE*points.size()+1);
+  else
+    bytes.resize(LASPOINT_SIZE*points.size()+1);
+  encode(&bytes[0],bytes.size());
+  blockMutex.unlock_shared();
+}
+
+void OctBuffer::write()
+{
+  static thread_local vector<char> blockBytes(BLOCKSIZE);
+  uint64_t slot;
+  char *addr;
+  blockMutex.lock_shared();
+  /* The flusher thread and a thread evicting the buffer may both try to
+   * write it. Only one does; nothing can dirty it while it's locked.
+   */
+  if (dirty.exchange(false))
+  {
+    store->nDirty--;
+    logBeginWrite(bufferNumber,blockNumber);
+#if DEBUG_STORE
+    cout<<"Writing block "<<blockNumber<<endl;
+#endif
+    slot=store->moveSlot(blockNumber,sizeClass());
+    addr=store->slotAddress(slot);
+    if (addr)
+      encode(addr,classSize[SLOT_CLASS(slot)]);
+    else
+    {
+      encode(&blockBytes[0],classSize[SLOT_CLASS(slot)]);
+      store->writeSlot(slot,&blockBytes[0]);
+    }
+    logEndWrite(bufferNumber,blockNumber);
+  }
   blockMutex.unlock_shared();
 }
 
 void OctBuffer::markDirty()
+/* Call with blockMutex locked. A block changed in place stays in its
+ * slot, so this, not moveSlot, is what tells the store that its saved
+ * index no longer matches the blocks.
+ */
 {
-  dirty=true;
+  if (!dirty.exchange(true))
+    store->nDirty++;
+  if (store->saved.load(memory_order_relaxed))
+    store->unsave();
 }
 
-void OctBuffer::own()
+bool OctBuffer::own()
+// Returns true if the thread already owned the buffer.
 {
   int t=thisThread();
+  bool ret;
   ownMutex.lock();
-  owningThread.insert(t);
+  ret=!owningThread.insert(t).second;
   ownMutex.unlock();
   if (store->ownMap[t].size()<=bufferNumber || store->ownMap[t][bufferNumber]!=bufferNumber)
   {
@@ -478,6 +967,7 @@ void OctBuffer::own()
     if (store->ownMap[t].size()>bufferNumber)
       swap(store->ownMap[t][bufferNumber],store->ownMap[t].back());
   }
+  return ret;
 }
 
 bool OctBuffer::ownAlone()
@@ -505,47 +995,54 @@ bool OctBuffer::iOwn()
   return ret;
 }
 
-void OctBuffer::read(int64_t block)
+void OctBuffer::decode(const char *block,int size)
+// Decodes the points from a block of size bytes.
 {
-  int i,f=block%store->nFiles,b=block/store->nFiles;
+  int i,n,cap;
   int nPoints=0;
   LasPoint pnt;
-  blockMutex.lock();
-  store->fileMutex[f].lock();
-  logBeginRead(bufferNumber,block);
-#if DEBUG_STORE
-  cout<<"Reading block "<<block<<" into "<<this<<' '<<this_thread::get_id()<<endl;
-#endif
-  blockNumber=block;
-  store->file[f].seekg(BLOCKSIZE*b);
   points.clear();
   high=-INFINITY;
   low=INFINITY;
-  for (i=0;i<RECORDS;i++)
+  scaling=-1;
+  if (block[size-1]==BLOCK_QUANT)
   {
-    pnt.read(store->file[f]);
-    if (!pnt.isEmpty())
+    const QuantHeader *header=(const QuantHeader *)block;
+    const QuantPoint *records=(const QuantPoint *)(block+QUANT_HEADER_SIZE);
+    int32_t base[3];
+    for (i=0;i<3;i++)
+      base[i]=littleEndian(header->base[i]);
+    n=littleEndian(header->nPoints);
+    scaling=header->scaling;
+    assert(n<=quantCapacity(size) && scaling<store->nScalings);
+    points.resize(n);
+    for (i=0;i<n;i++)
+      points[i].fromQuant(records[i],store->scalings[scaling],base);
+  }
+  else if (block[size-1]==BLOCK_DOUBLE)
+  {
+    const DiskPoint *records=(const DiskPoint *)block;
+    cap=doubleCapacity(size);
+    for (i=0;i<cap;i++)
     {
-      points.push_back(pnt);
-      if (pnt.location.elev()>high)
-	high=pnt.location.elev();
-      if (pnt.location.elev()<low)
-	low=pnt.location.elev();
-      nPoints++;
+      pnt.fromDisk(records[i]);
+      if (!pnt.isEmpty())
+	points.push_back(pnt);
     }
   }
-  store->file[f].clear();
-  /* If a new block is read in, all points will be at (0,0,0).
-   * In any other case (including all points being at (NAN,NAN,NAN)),
-   * points' locations will be unequal. (NAN is not equal to NAN.)
-   */
-  if (points.size()>1 && points[0].location==points[1].location)
+  // Otherwise it's a new block, and there are no points.
+  for (i=0;i<points.size();i++)
   {
-    points.clear();
-    high=-INFINITY;
-    low=INFINITY;
+    if (points[i].location.elev()>high)
+      high=points[i].location.elev();
+    if (points[i].location.elev()<low)
+      low=points[i].location.elev();
+    nPoints++;
   }
+  if (points.size()==0)
+    scaling=-1;
   points.shrink_to_fit();
+  indexPoints();
   if ((blockNumber>=WATCH_BLOCK_START && blockNumber<WATCH_BLOCK_END) || watchedBuffers.count(bufferNumber))
   {
     msgMutex.lock();
@@ -553,27 +1050,54 @@ void OctBuffer::read(int64_t block)
     watchedBuffers.erase(bufferNumber);
     msgMutex.unlock();
   }
+}
+
+void OctBuffer::read(int64_t block)
+{
+  static thread_local vector<char> blockBytes(BLOCKSIZE);
+  vector<char> tierBytes;
+  uint64_t slot=store->getSlot(block);
+  char *addr;
+  blockMutex.lock();
+  logBeginRead(bufferNumber,block);
+#if DEBUG_STORE
+  cout<<"Reading block "<<block<<" into "<<this<<' '<<this_thread::get_id()<<endl;
+#endif
+  blockNumber=block;
+  if (store->ramTier.take(block,tierBytes))
+    decode(&tierBytes[0],tierBytes.size());
+  else if (slot==0) // never written, so there are no points
+  {
+    blockBytes[SMALL_BLOCKSIZE-1]=BLOCK_NEW;
+    decode(&blockBytes[0],SMALL_BLOCKSIZE);
+  }
+  else if ((addr=store->slotAddress(slot))) // Decodes straight from the mapping.
+    decode(addr,classSize[SLOT_CLASS(slot)]);
+  else
+  {
+    store->readSlot(slot,&blockBytes[0]);
+    decode(&blockBytes[0],classSize[SLOT_CLASS(slot)]);
+  }
   logEndRead(bufferNumber,block);
-  store->fileMutex[f].unlock();
   blockMutex.unlock();
 }
 
+int OctBuffer::sizeClass()
+// Returns the smallest size class whose blocks can hold the points.
+{
+  int c;
+  for (c=0;c<BLOCK_CLASSES-1;c++)
+    if (points.size()<=(scaling>=0?quantCapacity(classSize[c]):doubleCapacity(classSize[c])))
+      break;
+  return c;
+}
+
 void OctBuffer::update()
 {
-  store->nowUsedMutex.lock();
-  store->nowUsed=clk.now().time_since_epoch().count()
-		 *store->clockNum/store->clockDen;
-  if (lastUsed+618<store->nowUsed)
-  {
-    pair<multimap<int64_t,int>::iterator,multimap<int64_t,int>::iterator> range=store->lastUsedMap.equal_range(lastUsed);
-    while (range.first!=range.second && range.first->second!=bufferNumber)
-      ++range.first;
-    if (range.first!=range.second)
-      store->lastUsedMap.erase(range.first);
-    lastUsed=store->nowUsed;
-    store->lastUsedMap.insert(pair<int64_t,int>(lastUsed,bufferNumber));
-  }
-  store->nowUsedMutex.unlock();
+  if (store->evictPolicy==EVICT_CLOCK)
+    store->clockEvictor.touch(bufferNumber);
+  else
+    store->lruEvictor.touch(bufferNumber);
 }
 
 void OctBuffer::flush()
@@ -582,10 +1106,35 @@ void OctBuffer::flush()
     write();
 }
 
+void OctBuffer::fill(vector<LasPoint> &pnts,int sc)
+/* Replaces the points with pnts (leaving pnts with the old points), which
+ * must fit, all of them in scaling sc if it isn't -1.
+ */
+{
+  int i;
+  blockMutex.lock();
+  points.swap(pnts);
+  indexPoints();
+  scaling=sc;
+  high=-INFINITY;
+  low=INFINITY;
+  for (i=0;i<points.size();i++)
+  {
+    if (points[i].location.elev()>high)
+      high=points[i].location.elev();
+    if (points[i].location.elev()<low)
+      low=points[i].location.elev();
+  }
+  markDirty();
+  blockMutex.unlock();
+}
+
 void OctBuffer::clear()
 {
   blockMutex.lock();
   points.clear();
+  indexPoints();
+  scaling=-1;
   blockMutex.unlock();
 }
 
@@ -596,19 +1145,41 @@ void OctBuffer::shrink()
   blockMutex.unlock();
 }
 
-LasPoint OctBuffer::get(xyz key)
+void OctBuffer::indexPoints()
+// Call with blockMutex locked exclusively.
 {
-  int i,inx=-1;
-  LasPoint ret;
-  blockMutex.lock_shared();
+  int i;
+  memset(&keySlots[0],0,KEY_SLOTS*sizeof(keySlots[0]));
   for (i=0;i<points.size();i++)
-  {
-    if (points[i].location==key)
-    {
-      inx=i;
-      break;
-    }
-  }
+    indexPoint(i);
+}
+
+void OctBuffer::indexPoint(int n)
+{
+  int i;
+  for (i=hashLocation(points[n].location)&(KEY_SLOTS-1);keySlots[i];i=(i+1)&(KEY_SLOTS-1));
+  keySlots[i]=n+1;
+}
+
+int OctBuffer::findPoint(xyz key)
+/* Returns the index of the point at key, or -1 if there is none.
+ * A block holds at most QRECORDS points, so at least half the slots
+ * are empty, and the probe stops at one.
+ */
+{
+  int i,n;
+  for (i=hashLocation(key)&(KEY_SLOTS-1);(n=keySlots[i]);i=(i+1)&(KEY_SLOTS-1))
+    if (n<=points.size() && points[n-1].location==key)
+      return n-1;
+  return -1;
+}
+
+LasPoint OctBuffer::get(xyz key)
+{
+  int inx;
+  LasPoint ret;
+  blockMutex.lock_shared();
+  inx=findPoint(key);
   if (inx>=0)
   {
     ret=points[inx];
@@ -618,20 +1189,25 @@ LasPoint OctBuffer::get(xyz key)
 }
 
 bool OctBuffer::put(LasPoint pnt)
-// Returns true if put, false if no room.
+/* Returns true if put, false if no room. If the new point can't be quantized
+ * with the same scaling as the others, the block holds only RECORDS points.
+ */
 {
-  int i,inx=-1;
+  int inx,newScaling;
   xyz key=pnt.location;
+  PointTally tally;
+  bool changed=false; // changes the aggregates
   blockMutex.lock();
-  for (i=0;i<points.size();i++)
-  {
-    if (points[i].location==key)
-    {
-      inx=i;
-      break;
-    }
-  }
-  if (inx>=0)
+  inx=findPoint(key);
+  if (points.size()==0 || (points.size()==1 && inx==0))
+    newScaling=store->findScaling(pnt);
+  else if (scaling>=0 && store->inScaling(pnt,scaling))
+    newScaling=scaling;
+  else
+    newScaling=-1;
+  if (newScaling<0 && points.size()+(inx<0)>RECORDS)
+    inx=-1; // no room as doubles, so the block must be split
+  else if (inx>=0)
   {
     if (points[inx].location==key && !store->ignoreDupes)
     {
@@ -640,24 +1216,37 @@ bool OctBuffer::put(LasPoint pnt)
       alreadyMutex.unlock();
     }
     markDirty();
+    if (points[inx].classification!=pnt.classification)
+    {
+      tally.add(points[inx],-1);
+      tally.add(pnt);
+      changed=true;
+    }
     points[inx]=pnt;
+    scaling=newScaling;
   }
-  else if (points.size()<RECORDS)
+  else if (points.size()<(newScaling>=0?QRECORDS:RECORDS))
   {
     inx=points.size();
     markDirty();
     points.push_back(pnt);
+    indexPoint(inx);
+    tally.add(pnt);
+    changed=true;
+    scaling=newScaling;
     if (pnt.location.elev()>high)
       high=pnt.location.elev();
     if (pnt.location.elev()<low)
       low=pnt.location.elev();
-    if (points.capacity()>RECORDS)
+    if (points.capacity()>QRECORDS)
     {
       points.shrink_to_fit();
-      points.reserve(RECORDS);
+      points.reserve(QRECORDS);
     }
   }
   blockMutex.unlock();
+  if (changed)
+    octRoot.addTally(key,tally);
   return inx>=0;
 }
 
@@ -688,47 +1277,31 @@ int OctBuffer::dump(ofstream &file,Cube cube)
   return nPoints;
 }
 
-void OctBuffer::plot(PostScript &ps,Cube cube)
-{
-  int i;
-  xyz ctr=cube.getCenter();
-  for (i=0;i<points.size();i++)
-    ps.dot(points[i].location);
-}
-
 OctStore::OctStore()
 {
   int i;
-  nowUsed=0;
   nBlocks=0;
+  nScalings=0;
+  nDirty=0;
+  for (i=0;i<BLOCK_CLASSES;i++)
+    nSlots[i]=0;
+  dirtyLow=DIRTY_LOW;
+  dirtyHigh=DIRTY_HIGH;
+  evictPolicy=EVICT_CLOCK;
+  ramTierLimit=-1;
   ignoreDupes=false;
-  clockNum=chrono::steady_clock::period::num;
-  clockDen=chrono::steady_clock::period::den;
-  // count()*clockNum/clockDen is in seconds
-  for (i=0;i<3;i++)
-    if (clockDen%5==0)
-      clockDen/=5;
-    else
-      clockNum*=5;
-  for (i=0;i<3;i++)
-    if (clockDen%2==0)
-      clockDen/=2;
-    else
-      clockNum*=2;
-  // count()*clockNum/clockDen is in milliseconds
+  saved=false;
   for (i=0;i<9;i++)
-  {
-    blocks[i].store=this;
-    blocks[i].bufferNumber=i;
-    blocks[i].blockNumber=-1;
-    blocks[i].update();
-  }
+    addBuffer(false)->update();
 }
 
 OctStore::~OctStore()
 {
+  int i;
   //flush();
   close();
+  for (i=0;i<blocks.size();i++)
+    delete getBuffer(i);
 }
 
 void OctStore::flush(int thread,int nthreads)
@@ -738,8 +1311,7 @@ void OctStore::flush(int thread,int nthreads)
   assert(nthreads>0);
   for (i=thread;i<blocks.size();i+=nthreads)
   {
-    assert(blocks.count(i));
-    buf=&blocks[i];
+    buf=getBuffer(i);
     buf->flush();
   }
 }
@@ -752,9 +1324,7 @@ void OctStore::disown()
   {
     n=ownMap[t][i];
     assert(n>=0);
-    bufferMutex.lock_shared();
-    buf=&blocks[n];
-    bufferMutex.unlock_shared();
+    buf=getBuffer(n);
     buf->ownMutex.lock();
     buf->owningThread.erase(t);
     buf->ownMutex.unlock();
@@ -762,25 +1332,102 @@ void OctStore::disown()
   ownMap[t].clear();
 }
 
+void OctStore::setEvictPolicy(int policy)
+{
+  evictPolicy=policy;
+}
+
+void OctStore::setRamTier(double bytes)
+{
+  ramTierLimit=bytes;
+  if (bytes>=0)
+    ramTier.shrink(bytes);
+}
+
+void OctStore::stash(OctBuffer *buf,double fram)
+/* Keeps a copy of a block that is being evicted, which must already be
+ * written, in the RAM tier. The tier grows only while there is more than
+ * lowRam/2 free, the same margin below which getBlock stops allocating
+ * buffers, and gives back what is needed to get above it.
+ */
+{
+  vector<char> bytes;
+  double limit=(ramTierLimit<0)?lowRam:ramTierLimit;
+  if (limit>ramTier.size()+fram-lowRam/2)
+    limit=ramTier.size()+fram-lowRam/2;
+  if (limit<0)
+    limit=0;
+  if (buf->points.size() && limit>0)
+  {
+    buf->compact(bytes);
+    ramTier.put(buf->blockNumber,bytes,limit);
+  }
+  else
+    ramTier.shrink(limit);
+}
+
+void OctStore::setDirtyMarks(double low,double high)
+{
+  dirtyLow=low;
+  dirtyHigh=high;
+}
+
+bool OctStore::tooDirty()
+{
+  return nDirty>dirtyHigh*blocks.size();
+}
+
+int OctStore::writeBehind()
+/* Writes dirty buffers that no thread owns, least recently used first,
+ * until no more than dirtyLow of them are dirty, so that a thread that
+ * evicts a buffer seldom has to write it first. Called by the flusher
+ * thread. Returns the number of buffers written.
+ */
+{
+  int i,n=0,target;
+  bool owned;
+  vector<int> cands;
+  OctBuffer *buf;
+  auto want=[this](int i)
+  {
+    return getBuffer(i)->dirty && !getBuffer(i)->inTransit && getBuffer(i)->owningThread.size()==0;
+  };
+  target=lrint(dirtyLow*blocks.size());
+  if (nDirty<=target)
+    ;
+  else if (evictPolicy==EVICT_CLOCK)
+    cands=clockEvictor.coldest(nDirty-target,want);
+  else
+    cands=lruEvictor.coldest(nDirty-target,want);
+  for (i=0;i<cands.size() && nDirty>target;i++)
+    if (setTransit(cands[i],true))
+    {
+      buf=getBuffer(cands[i]);
+      buf->ownMutex.lock();
+      owned=buf->owningThread.size()>0;
+      buf->ownMutex.unlock();
+      if (!owned && buf->dirty)
+      {
+	buf->write();
+	n++;
+      }
+      setTransit(cands[i],false);
+    }
+  return n;
+}
+
 bool OctStore::setTransit(int buffer,bool t)
 /* Returns true if successful. If t is true, and the buffer is already
  * in transit, returns false.
  */
 {
-  bool ret=true;
-  bufferMutex.lock_shared();
+  bool ret=true,expected=false;
   assert(buffer>=0);
-  OctBuffer *buf=&blocks[buffer];
-  bufferMutex.unlock_shared();
-  transitMutex.lock();
+  OctBuffer *buf=getBuffer(buffer);
   if (t)
-    if (buf->inTransit)
-      ret=false;
-    else
-      buf->inTransit=true;
+    ret=buf->inTransit.compare_exchange_strong(expected,true);
   else
     buf->inTransit=false;
-  transitMutex.unlock();
   return ret;
 }
 
@@ -791,14 +1438,17 @@ void OctStore::resize(int n)
   flush();
   bufferMutex.lock();
   for (i=blocks.size();i<n;i++)
-  {
-    blocks[i].store=this;
-    blocks[i].bufferNumber=i;
-    blocks[i].blockNumber=-1;
-    blocks[i].update();
-  }
+    addBuffer(false)->update();
   for (i=blocks.size()-1;i>=n;i--)
-    blocks.erase(i);
+  { // Only done when no other thread is using the store
+    if (getBuffer(i)->blockNumber>=0 && bufferOf(getBuffer(i)->blockNumber)==i)
+      setBufferOf(getBuffer(i)->blockNumber,-1);
+    delete getBuffer(i);
+    blocks[i]=nullptr;
+    blocks.setSize(i);
+  }
+  lruEvictor.resize(blocks.size());
+  clockEvictor.resize(blocks.size());
   bufferMutex.unlock();
 }
 
@@ -806,28 +1456,330 @@ void OctStore::shrink()
 {
   int i;
   for (i=0;i<blocks.size();i++)
-    blocks[i].shrink();
+    getBuffer(i)->shrink();
+}
+
+void OctStore::open(string fileName,int numFiles,int mode,bool keep)
+/* mode is STORE_STREAM, STORE_MMAP, or STORE_PREAD. If the files can't
+ * be mapped, they are read and written with pread, or failing that, as
+ * streams. A stream has a lock, so numFiles streams are opened to keep
+ * threads from waiting for each other; the other modes use one file.
+ * Small blocks go in files whose names have an "s". If keep is true, the
+ * files are not truncated, so that resume can use them.
+ */
+{
+  int i,c;
+  string names[BLOCK_CLASSES]={fileName+"s",fileName};
+  storeName=fileName;
+  storeFiles=numFiles;
+  storeMode=mode;
+  if (!keep)
+  {
+    saved=false;
+    remove((fileName+"i").c_str());
+  }
+  nFiles=1;
+  for (c=0;c<BLOCK_CLASSES;c++)
+  {
+    file[c][0].open(names[c]+"0",mode,MMAP_RESERVE/classSize[c]*classSize[c],keep);
+    if (file[c][0].getMode()==STORE_STREAM && numFiles>1)
+      nFiles=numFiles;
+  }
+  for (c=0;c<BLOCK_CLASSES;c++)
+    for (i=1;i<nFiles;i++)
+      file[c][i].open(names[c]+to_string(i),mode,0,keep);
+}
+
+void OctStore::save(const vector<string> &sources)
+/* Writes the buffers back, then writes what is needed to reopen the
+ * store: the octree, the slot and point count of each block, the free
+ * slots, and the scalings. sources identifies the point cloud files the
+ * store was made from. Call when no other thread is using the store.
+ */
+{
+  ofstream idx(storeName+"i",ios::binary);
+  int64_t i;
+  int c;
+  flush();
+  saved=true; // If a block moves while this is being written, unsave removes the file.
+  writeustring(idx,STORE_INDEX_MAGIC);
+  writeleint(idx,STORE_INDEX_VERSION);
+  writeleint(idx,BLOCKSIZE);
+  writeleint(idx,SMALL_BLOCKSIZE);
+  writeleint(idx,nFiles);
+  writeleint(idx,sources.size());
+  for (i=0;i<sources.size();i++)
+    writeustring(idx,sources[i]);
+  octRoot.save(idx);
+  writelelong(idx,nBlocks);
+  for (i=0;i<nBlocks;i++)
+  {
+    writelelong(idx,getSlot(i));
+    writeleshort(idx,(i<blockPointCount.size())?blockPointCount[i]:0);
+  }
+  for (c=0;c<BLOCK_CLASSES;c++)
+  {
+    writelelong(idx,nSlots[c]);
+    writelelong(idx,freeSlots[c].size());
+    for (i=0;i<freeSlots[c].size();i++)
+      writelelong(idx,freeSlots[c][i]);
+  }
+  writeleint(idx,nScalings);
+  for (i=0;i<nScalings;i++)
+    scalings[i].write(idx);
+  idx.close();
+  if (!idx.good())
+  {
+    saved=false;
+    cerr<<"Can't write "<<storeName<<"i\n";
+    remove((storeName+"i").c_str());
+  }
+}
+
+bool OctStore::resume(const vector<string> &sources)
+/* If the store was saved from the same sources, reopens its files without
+ * truncating them and loads what save wrote, so that the points needn't
+ * be read again. Otherwise truncates the files and returns false. Call
+ * before reading any points, when no other thread is using the store.
+ */
+{
+  ifstream idx(storeName+"i",ios::binary);
+  int i,c,n,savedFiles=1;
+  int64_t b,count,idxSize=0;
+  bool ok=idx.is_open(),reopened=false;
+  if (ok)
+  { // Counts read from a damaged file are checked against its size.
+    idx.seekg(0,ios::end);
+    idxSize=idx.tellg();
+    idx.seekg(0);
+  }
+  if (ok)
+    ok=readustring(idx)==STORE_INDEX_MAGIC && readleint(idx)==STORE_INDEX_VERSION;
+  if (ok)
+    ok=readleint(idx)==BLOCKSIZE && readleint(idx)==SMALL_BLOCKSIZE;
+  if (ok)
+  {
+    savedFiles=readleint(idx);
+    n=readleint(idx);
+    ok=n==sources.size();
+  }
+  for (i=0;ok && i<n;i++)
+    ok=readustring(idx)==sources[i];
+  if (ok)
+  {
+    forgetBuffers();
+    clear();
+    close();
+    open(storeName,savedFiles,storeMode,true);
+    ok=reopened=nFiles==savedFiles;
+  }
+  if (ok)
+  {
+    octRoot.load(idx);
+    count=readlelong(idx);
+    ok=idx.good() && count>=0 && count<=(idxSize-idx.tellg())/10 &&
+       count<=((int64_t)BLOCK_MAXCHUNKS<<BLOCK_CHUNK_BITS);
+  }
+  if (ok)
+  {
+    nBlocks=count;
+    blockSlot.reserve(nBlocks);
+    for (b=0;b<nBlocks;b++)
+    {
+      blockSlot[b].store(readlelong(idx),memory_order_relaxed);
+      blockPointCount.push_back(readleshort(idx));
+    }
+    blockGroupCount.resize((nBlocks+255)/256);
+    for (b=0;b<nBlocks;b++)
+      blockGroupCount[b/256]+=blockPointCount[b];
+    for (c=0;ok && c<BLOCK_CLASSES;c++)
+    {
+      nSlots[c]=readlelong(idx);
+      count=readlelong(idx);
+      ok=idx.good() && count>=0 && count<=(idxSize-idx.tellg())/8;
+      if (ok)
+	freeSlots[c].resize(count);
+      for (b=0;ok && b<freeSlots[c].size();b++)
+	freeSlots[c][b]=readlelong(idx);
+    }
+    if (ok)
+      nScalings=readleint(idx);
+    ok=ok && nScalings>=0 && nScalings<=MAX_SCALINGS;
+    for (i=0;ok && i<nScalings;i++)
+      scalings[i].read(idx);
+    ok=ok && idx.good();
+  }
+  if (reopened && !ok)
+  {
+    cerr<<"Index file "<<storeName<<"i is damaged\n";
+    octRoot.clear();
+    clear();
+  }
+  if (ok)
+    saved=true;
+  else
+  {
+    close();
+    open(storeName,storeFiles,storeMode);
+  }
+  return ok;
+}
+
+void OctStore::unsave()
+/* Called when a block is added or moved to another slot, which the index
+ * file doesn't know about.
+ */
+{
+  if (saved.exchange(false))
+    remove((storeName+"i").c_str());
 }
 
-void OctStore::open(string fileName,int numFiles)
+void OctStore::forgetBuffers()
+// Empties the buffers without writing them.
 {
   int i;
-  OctBuffer *blkPtr;
-  nFiles=numFiles;
-  if (nFiles<1)
-    nFiles=1;
-  for (i=0;i<nFiles;i++)
+  OctBuffer *buf;
+  for (i=0;i<blocks.size();i++)
+  {
+    buf=getBuffer(i);
+    if (buf->blockNumber>=0)
+      setBufferOf(buf->blockNumber,-1);
+    buf->blockNumber=-1;
+    buf->clear();
+    if (buf->dirty.exchange(false))
+      nDirty--;
+  }
+  ramTier.clear();
+}
+
+uint64_t OctStore::getSlot(int64_t block)
+// Returns the slot word of the block, or 0 if it has never been written.
+{
+  atomic<uint64_t> *entry=blockSlot.find(block);
+  return entry?entry->load(memory_order_acquire):0;
+}
+
+uint64_t OctStore::moveSlot(int64_t block,int cls)
+/* Returns the slot the block is to be written in. If it isn't in a slot
+ * of class cls, gives it one and frees the one it was in. Nobody can be
+ * reading the old slot, since the block is in a buffer.
+ */
+{
+  uint64_t old=getSlot(block),ret;
+  int64_t slot;
+  if (old && SLOT_CLASS(old)==cls)
+    return old;
+  unsave();
+  slotMutex.lock();
+  if (freeSlots[cls].size())
+  {
+    slot=freeSlots[cls].back();
+    freeSlots[cls].pop_back();
+  }
+  else
+    slot=nSlots[cls]++;
+  if (old)
+    freeSlots[SLOT_CLASS(old)].push_back(SLOT_NUMBER(old));
+  slotMutex.unlock();
+  ret=((uint64_t)cls<<56)|(slot+1);
+  blockSlot.reserve(block+1);
+  blockSlot[block].store(ret,memory_order_release);
+  return ret;
+}
+
+char *OctStore::slotAddress(uint64_t slotWord)
+// Returns the address of the slot if its file is mapped, else nullptr.
+{
+  int c=SLOT_CLASS(slotWord);
+  int64_t slot=SLOT_NUMBER(slotWord);
+  BlockFile &bf=file[c][slot%nFiles];
+  if (bf.getMode()==STORE_MMAP)
+    return bf.address(slot/nFiles*classSize[c],classSize[c]);
+  else
+    return nullptr;
+}
+
+void OctStore::readSlot(uint64_t slotWord,char *buf)
+{
+  int c=SLOT_CLASS(slotWord);
+  int64_t slot=SLOT_NUMBER(slotWord);
+  file[c][slot%nFiles].readBlock(slot/nFiles*classSize[c],buf,classSize[c]);
+}
+
+void OctStore::writeSlot(uint64_t slotWord,const char *buf)
+{
+  int c=SLOT_CLASS(slotWord);
+  int64_t slot=SLOT_NUMBER(slotWord);
+  file[c][slot%nFiles].writeBlock(slot/nFiles*classSize[c],buf,classSize[c]);
+}
+
+int OctStore::addScaling(const LasScaling &sc)
+/* Adds the scaling of an input file, so that its points can be stored
+ * quantized. Returns its index, or -1 if it can't be used.
+ */
+{
+  int i,n,ret=-1;
+  if (sc.isValid())
+  {
+    scalingMutex.lock();
+    n=nScalings;
+    for (i=0;ret<0 && i<n;i++)
+      if (scalings[i]==sc)
+	ret=i;
+    if (ret<0 && n<MAX_SCALINGS)
+    {
+      scalings[n]=sc;
+      nScalings.store(n+1,memory_order_release);
+      ret=n;
+    }
+    scalingMutex.unlock();
+  }
+  return ret;
+}
+
+int OctStore::findScaling(const LasPoint &pnt)
+// Returns the first scaling in which pnt can be quantized, or -1.
+{
+  int i,n=nScalings.load(memory_order_acquire),ret=-1;
+  if (pnt.fitsQuant())
+    for (i=0;ret<0 && i<n;i++)
+      if (inScaling(pnt,i))
+	ret=i;
+  return ret;
+}
+
+bool OctStore::inScaling(const LasPoint &pnt,int sc)
+{
+  int32_t q[3];
+  return pnt.fitsQuant() && scalings[sc].quantize(pnt.location,q);
+}
+
+int OctStore::commonScaling(const vector<LasPoint> &pnts,int sc)
+/* Returns a scaling in which all of pnts can be quantized, trying sc
+ * first, or -1 if there is none. Only the first point's first scaling
+ * is tried after sc.
+ */
+{
+  int i,n;
+  for (n=0;n<2;n++)
   {
-    file[i].open(fileName+to_string(i),ios::in|ios::out|ios::binary|ios::trunc);
-    //cout<<fileName+to_string(i)<<' '<<file[i].is_open()<<endl;
+    if (n && pnts.size())
+      sc=findScaling(pnts[0]);
+    for (i=0;sc>=0 && i<pnts.size();i++)
+      if (!inScaling(pnts[i],sc))
+	sc=-1;
+    if (sc>=0)
+      break;
   }
+  return sc;
 }
 
 void OctStore::close()
 {
-  int i;
-  for (i=0;i<nFiles;i++)
-    file[i].close();
+  int i,c;
+  for (c=0;c<BLOCK_CLASSES;c++)
+    for (i=0;i<nFiles;i++)
+      file[c][i].close();
 }
 
 LasPoint OctStore::get(xyz key)
@@ -859,14 +1811,16 @@ void OctStore::put(LasPoint pnt,bool splitting)
   assert(pBlock->iOwn());
   blkn0=pBlock->blockNumber;
   assert(blkn0>=0);
-  if (!pBlock->put(pnt))
+  /* If all the points are in one octant, the block that gets pnt may
+   * be full again, so keep splitting until it isn't.
+   */
+  while (!pBlock->put(pnt))
   {
     if (splitting)
       cout<<"split called inside split\n";
     blkn1=pBlock->blockNumber;
-    split(pBlock->blockNumber,key); // Write-locks cube, then unlocks it
-    pBlock=getBlock(key,true); // Read-locks a smaller cube
-    pBlock->put(pnt);
+    split(pBlock->blockNumber,key); // Locks cube, splits it, and unlocks it
+    pBlock=getBlock(key,true); // Locks a smaller cube
   }
   blkn2=pBlock->blockNumber;
   if (!splitting)
@@ -875,6 +1829,39 @@ void OctStore::put(LasPoint pnt,bool splitting)
     cout<<"Block number changed\n";
 }
 
+bool OctStore::fitsBlock(const vector<LasPoint> &pnts)
+{
+  return pnts.size()<=RECORDS || (pnts.size()<=QRECORDS && commonScaling(pnts)>=0);
+}
+
+int64_t OctStore::newLeaf(xyz pnt,int depth,vector<LasPoint> &pnts)
+/* Makes a new block of pnts, which must pass fitsBlock, and puts it in the
+ * octree in the cube at depth containing pnt. pnts is left empty. The block
+ * is filled before the octree shows it, as in split.
+ */
+{
+  int64_t blk;
+  int i;
+  OctBuffer *buf;
+  PointTally tally;
+  for (i=0;i<pnts.size();i++)
+    tally.add(pnts[i]);
+  setBlockMutex.lock();
+  unsave();
+  blk=nBlocks++;
+  setBlockMutex.unlock();
+  buf=getBlock(blk);
+  buf->fill(pnts,commonScaling(pnts));
+  pnts.clear();
+  updateCount(blk,buf->points.size());
+  setBlockMutex.lock();
+  octRoot.setLeaf(pnt,blk,depth);
+  setBlockMutex.unlock();
+  octRoot.addTally(pnt,tally);
+  disown();
+  return blk;
+}
+
 map<int,size_t> OctStore::countClasses(int64_t block)
 {
   return getBlock(block)->countClasses();
@@ -890,12 +1877,28 @@ void OctStore::dump(ofstream &file)
   file<<octRoot.dump(file)<<" total points\n";
 }
 
-void OctStore::plot(PostScript &ps)
+vector<LasPoint> OctStore::samplePointsIn(const Shape &sh,double spacing)
+/* Returns the points in sh, or, where the octree is dense, a sample of
+ * them about spacing apart. A spacing of 0 returns all the points.
+ */
+{
+  vector<LasPoint> ret;
+  sampleMutex.lock();
+  octRoot.samplePoints(sh,spacing,ret);
+  sampleMutex.unlock();
+  return ret;
+}
+
+void OctStore::plot(PostScript &ps,double spacing)
 {
+  int i;
+  vector<LasPoint> pnts;
   ps.startpage();
   ps.setscale(octRoot.cube().minX(),octRoot.cube().minY(),
 	      octRoot.cube().maxX(),octRoot.cube().maxY());
-  octRoot.plot(ps);
+  pnts=samplePointsIn(Cylinder(xy(octRoot.getCenter()),octRoot.getSide()),spacing);
+  for (i=0;i<pnts.size();i++)
+    ps.dot(pnts[i].location);
   ps.endpage();
 }
 
@@ -914,16 +1917,20 @@ void OctStore::dumpBuffers()
   set<int>::iterator j;
   for (i=0;i<blocks.size();i++)
   {
-    cout<<"buf "<<i<<" blk "<<blocks[i].blockNumber<<" lastUsed "<<blocks[i].lastUsed;
-    if (blocks[i].dirty)
+    cout<<"buf "<<i<<" blk "<<getBuffer(i)->blockNumber;
+    if (evictPolicy==EVICT_CLOCK)
+      cout<<(clockEvictor.isReferenced(i)?" referenced":"");
+    else
+      cout<<" lastUsed "<<lruEvictor.getLastUsed(i);
+    if (getBuffer(i)->dirty)
       cout<<" dirty";
-    if (blocks[i].inTransit)
+    if (getBuffer(i)->inTransit)
       cout<<" inTransit";
-    cout<<' '<<blocks[i].points.size()<<" points";
-    if (blocks[i].owningThread.size())
+    cout<<' '<<getBuffer(i)->points.size()<<" points";
+    if (getBuffer(i)->owningThread.size())
     {
       cout<<" owned by";
-      for (j=blocks[i].owningThread.begin();j!=blocks[i].owningThread.end();++j)
+      for (j=getBuffer(i)->owningThread.begin();j!=getBuffer(i)->owningThread.end();++j)
 	cout<<' '<<*j;
     }
     cout<<endl;
@@ -964,69 +1971,109 @@ void OctStore::updateCount(int64_t block,int nPoints)
 
 int OctStore::leastRecentlyUsed(int thread,int nthreads)
 {
-  int i,age,maxAge=-1,ret=-1;
-  map<int64_t,int>::iterator j;
+  int ret;
+  auto usable=[this](int i)
+  {
+    return !getBuffer(i)->inTransit && getBuffer(i)->owningThread.size()==0;
+  };
   if (thread<0) // called by dump in the main thread after worker threads have finished
   {
     thread=0;
     nthreads=1;
   }
-  nowUsedMutex.lock_shared();
-  j=lastUsedMap.begin();
-  if (lastUsedMap.size())
-    for (;ret<0 && j!=lastUsedMap.end();++j)
-    {
-      i=j->second;
-      if (!blocks[i].inTransit && blocks[i].owningThread.size()==0)
-	ret=i;
-    }
+  if (evictPolicy==EVICT_CLOCK)
+    ret=clockEvictor.victim(thread,usable);
   else
-    for (i=0;i<blocks.size();i++)
-    {
-      age=nowUsed-blocks[i].lastUsed;
-      if (age>maxAge)
-      {
-	maxAge=age;
-	ret=i;
-      }
-    }
+    ret=lruEvictor.victim(usable);
   if (ret<0)
     dumpBuffers();
   assert(ret>=0);
-  nowUsedMutex.unlock_shared();
   return ret;
 }
 
+OctBuffer *OctStore::addBuffer(bool owned)
+/* Call with bufferMutex locked. The buffer is put in the table before
+ * the evictors know of it, so anything an evictor returns is there.
+ */
+{
+  int i=blocks.size();
+  OctBuffer *buf=new OctBuffer;
+  buf->store=this;
+  buf->bufferNumber=i;
+  buf->blockNumber=-1;
+  if (owned)
+    buf->owningThread.insert(thisThread());
+  blocks.reserve(i+1);
+  blocks[i].store(buf,memory_order_release);
+  blocks.setSize(i+1);
+  lruEvictor.resize(i+1);
+  clockEvictor.resize(i+1);
+  return buf;
+}
+
 int OctStore::newBlock()
 // The new block is owned.
 {
-  int t=thisThread();
+  int i,t=thisThread();
   bufferMutex.lock();
-  int i=blocks.size();
-  OctBuffer *buf=&blocks[i];
-  buf->ownMutex.lock();
+  i=addBuffer(true)->bufferNumber;
   bufferMutex.unlock();
-  buf->store=this;
-  buf->bufferNumber=i;
-  buf->owningThread.insert(t);
-  buf->ownMutex.unlock();
   ownMap[t].push_back(i);
   return i;
 }
 
+int OctStore::bufferOf(int64_t block)
+// Returns the buffer the block is in, or -1.
+{
+  atomic<int> *entry=revBlocks.find(block);
+  return entry?entry->load(memory_order_acquire)-1:-1;
+}
+
+void OctStore::setBufferOf(int64_t block,int buf)
+{
+  revBlocks.reserve(block+1);
+  revBlocks[block].store(buf+1,memory_order_release);
+}
+
+OctBuffer *OctStore::findBuffer(int64_t block,int &bufnum)
+/* If the block is in a buffer, owns the buffer and returns it, else
+ * returns nullptr. Another thread may be taking the buffer for another
+ * block; that thread marks it in transit before checking that no other
+ * thread owns it, so after owning it, if it isn't in transit and still
+ * holds the block, it's safe to use.
+ */
+{
+  OctBuffer *buf;
+  bool wasOwned;
+  int t=thisThread();
+  while (true)
+  {
+    bufnum=bufferOf(block);
+    if (bufnum<0)
+      return nullptr;
+    buf=getBuffer(bufnum);
+    wasOwned=buf->own();
+    if (!buf->inTransit && bufferOf(block)==bufnum)
+      return buf;
+    if (!wasOwned)
+    {
+      buf->ownMutex.lock();
+      buf->owningThread.erase(t);
+      buf->ownMutex.unlock();
+    }
+    this_thread::yield();
+  }
+}
+
 OctBuffer *OctStore::getBlock(int64_t block,bool mustExist)
 {
-  streampos fileSize;
-  int lru=-1,bufnum=-1,i=0,f=block%nFiles,b=block/nFiles;
-  bool found=false,transitResult,ownResult;
+  int lru=-1,bufnum=-1,i=0;
+  bool found=false,loading,transitResult,ownResult;
   int t=thisThread();
   int gotBlock=0;
+  int64_t evicted;
   OctBuffer *buf;
   double fram;
-  fileMutex[f].lock();
-  file[f].seekg(0,file[f].end); // With more than one file, seek the file the block is in.
-  fileSize=file[f].tellg();
-  fileMutex[f].unlock();
   if (block>=WATCH_BLOCK_START && block<WATCH_BLOCK_END)
   {
     msgMutex.lock();
@@ -1034,31 +2081,36 @@ OctBuffer *OctStore::getBlock(int64_t block,bool mustExist)
     msgMutex.unlock();
   }
   assert(block>=0);
-  if (BLOCKSIZE*b>=fileSize && mustExist)
+  if (mustExist && !getSlot(block) && bufferOf(block)<0)
     return nullptr;
   else
   {
-    revMutex.lock_shared();
-    found=revBlocks.count(block);
-    if (found)
+    /* Another thread (a worker or the prefetcher) may be reading the same
+     * block. Wait for it, rather than reading it into a second buffer.
+     */
+    while (true)
     {
-      bufnum=revBlocks[block];
-      bufferMutex.lock_shared();
-      buf=&blocks[bufnum];
-      bufferMutex.unlock_shared();
-      buf->own();
+      buf=findBuffer(block,bufnum);
+      found=buf!=nullptr;
+      if (found)
+	break;
+      loadMutex.lock();
+      loading=loadingBlocks.count(block) || bufferOf(block)>=0;
+      if (!loading)
+	loadingBlocks.insert(block);
+      loadMutex.unlock();
+      if (!loading)
+	break;
+      this_thread::yield();
     }
-    revMutex.unlock_shared();
     if (!found)
     {
       while (!gotBlock)
       {
 	lru=leastRecentlyUsed(t,nThreads());
 	bufnum=lru;
-	bufferMutex.lock_shared();
 	assert(bufnum>=0);
-	buf=&blocks[bufnum];
-	bufferMutex.unlock_shared();
+	buf=getBuffer(bufnum);
 	fram=freeRam();
 	/* If fram>lowRam, always allocate a new buffer.
 	 * If fram<lowRam but fram>lowRam/2, allocate a new buffer or reuse an old one.
@@ -1070,12 +2122,7 @@ OctBuffer *OctStore::getBlock(int64_t block,bool mustExist)
 	{
 	  transitResult=setTransit(bufnum,true);
 	  if (transitResult)
-	    if (t>=0)
-	      ownResult=buf->ownAlone();
-	    else
-	      ownResult=true;
-	  else
-	    ;
+	    ownResult=buf->ownAlone();
 	  if (transitResult && ownResult)
 	    gotBlock=1; // reuse buffer
 	  else
@@ -1100,32 +2147,39 @@ OctBuffer *OctStore::getBlock(int64_t block,bool mustExist)
 	  }
 	}
       } // while (!gotBlock)
+      if (gotBlock!=1)
+	lru=-1; // not ours to take out of transit
       if (gotBlock==1)
-      {
-	revMutex.lock();
-	revBlocks.erase(buf->blockNumber);
-	revMutex.unlock();
+      { // The evicted block can't be read back until it's written.
+	evicted=buf->blockNumber;
+	loadMutex.lock();
+	loadingBlocks.insert(evicted);
+	loadMutex.unlock();
+	if (evicted>=0)
+	  setBufferOf(evicted,-1);
 	buf->flush();
+	if (evicted>=0)
+	  stash(buf,fram);
+	loadMutex.lock();
+	loadingBlocks.erase(evicted);
+	loadMutex.unlock();
 	buf->read(block);
       }
       else
       {
 	bufnum=newBlock();
 	assert(bufnum>=0);
-	bufferMutex.lock_shared();
-	buf=&blocks[bufnum];
-	bufferMutex.unlock_shared();
+	buf=getBuffer(bufnum);
 	buf->read(block);
 	buf->blockNumber=block;
       }
-      revMutex.lock();
-      revBlocks[block]=bufnum;
-      revMutex.unlock();
+      setBufferOf(block,bufnum);
+      loadMutex.lock();
+      loadingBlocks.erase(block);
+      loadMutex.unlock();
     }
     assert(bufnum>=0);
-    bufferMutex.lock_shared();
-    buf=&blocks[bufnum];
-    bufferMutex.unlock_shared();
+    buf=getBuffer(bufnum);
     buf->update();
     assert(lru>=-1);
     if (lru>=0)
@@ -1136,9 +2190,7 @@ OctBuffer *OctStore::getBlock(int64_t block,bool mustExist)
       cout<<"Got block "<<block<<" in buffer "<<bufnum<<endl;
       msgMutex.unlock();
     }
-    bufferMutex.lock_shared();
-    buf=&blocks[bufnum];
-    bufferMutex.unlock_shared();
+    buf=getBuffer(bufnum);
     assert(buf->iOwn());
     if (getThreadCommand()!=TH_SPLIT)
       updateCount(block,buf->points.size());
@@ -1146,6 +2198,29 @@ OctBuffer *OctStore::getBlock(int64_t block,bool mustExist)
   }
 }
 
+bool OctStore::prefetch(int64_t block)
+/* Reads a block that a thread will soon need into a buffer, if it isn't
+ * already in one. Returns true if it read the block. Does nothing unless
+ * there is RAM for a new buffer, since evicting a block for one that is
+ * needed later could throw out a block a worker is about to use.
+ */
+{
+  if (bufferOf(block)>=0 || freeRam()<=lowRam)
+    return false;
+  return getBlock(block,true)!=nullptr;
+}
+
+void OctStore::addThreads(int n)
+/* Makes the ownership lists of the main thread (-1), n worker threads,
+ * and the prefetch and flush threads, so that a thread's first use of
+ * its list doesn't insert into ownMap while other threads are reading it.
+ */
+{
+  int i;
+  for (i=-1;i<n+2;i++)
+    ownMap[i];
+}
+
 OctBuffer *OctStore::getBlock(xyz key,bool writing)
 // Leaves the cube locked.
 {
@@ -1155,16 +2230,22 @@ OctBuffer *OctStore::getBlock(xyz key,bool writing)
   bool gotCubeLock=false;
   while (!gotCubeLock)
   {
-    setBlockMutex.lock_shared();
     cube=octRoot.findCube(key);
-    setBlockMutex.unlock_shared();
     gotCubeLock=lockCube(cube);
     if (gotCubeLock)
     {
-      setBlockMutex.lock_shared();
       blknum=octRoot.findBlock(key);
-      setBlockMutex.unlock_shared();
+      /* If another thread split the cube before we got it, the lock
+       * doesn't cover the leaf the point is now in.
+       */
+      if (octRoot.findCube(key).getSide()!=cube.getSide())
+      {
+	unlockCube();
+	gotCubeLock=false;
+      }
     }
+    if (!gotCubeLock)
+      this_thread::yield();
   }
   if (blknum>=0)
   {
@@ -1176,6 +2257,7 @@ OctBuffer *OctStore::getBlock(xyz key,bool writing)
     blknum=octRoot.findBlock(key);
     if (blknum<0)
     {
+      unsave();
       blknum=nBlocks++;
       octRoot.setBlock(key,blknum);
     }
@@ -1199,9 +2281,24 @@ void OctStore::clearBlocks()
 }
 
 void OctStore::clear()
-// Do this after clearing the octree.
+/* Do this after clearing the octree. Forgets where the blocks are and
+ * which slots are free, as the files are about to be truncated.
+ */
 {
+  int64_t b;
+  int c;
+  atomic<uint64_t> *entry;
+  for (b=0;b<nBlocks;b++)
+    if ((entry=blockSlot.find(b)))
+      entry->store(0,memory_order_relaxed);
+  for (c=0;c<BLOCK_CLASSES;c++)
+  {
+    nSlots[c]=0;
+    freeSlots[c].clear();
+  }
   nBlocks=0;
+  nScalings=0;
+  ramTier.clear();
   blockGroupCount.clear();
   blockPointCount.clear();
 }
@@ -1213,28 +2310,18 @@ bool lowerThan(const LasPoint &a,const LasPoint &b)
 
 vector<LasPoint> OctStore::pointsIn(const Shape &sh,bool sorted)
 {
-  vector<int64_t> blockList=octRoot.findBlocks(sh);
-  OctBuffer *buf;
-  Cube cube;
   vector<LasPoint> ret;
-  int i,j;
-  ret.reserve(blockList.size()*RECORDS);
-  for (i=0;i<blockList.size();i++)
+  octRoot.visitBlocks(sh,[this,&sh,&ret](int64_t block,bool inside)
   {
-    buf=getBlock(blockList[i]);
-    if (buf->points.size())
-      cube=octRoot.findCube(buf->points[0].location);
-    if (sh.in(cube))
-    {
-      j=ret.size();
-      ret.resize(j+buf->points.size());
-      memmove(&ret[j],&buf->points[0],buf->points.size()*sizeof(LasPoint));
-    }
+    OctBuffer *buf=getBlock(block);
+    int j;
+    if (inside)
+      ret.insert(ret.end(),buf->points.begin(),buf->points.end());
     else
       for (j=0;j<buf->points.size();j++)
 	if (sh.in(buf->points[j].location))
 	  ret.push_back(buf->points[j]);
-  }
+  });
   if (sorted)
     sort(ret.begin(),ret.end(),lowerThan);
   ret.shrink_to_fit();
@@ -1243,23 +2330,21 @@ vector<LasPoint> OctStore::pointsIn(const Shape &sh,bool sorted)
 
 uint64_t OctStore::countPointsIn(const Shape &sh)
 {
-  vector<int64_t> blockList=octRoot.findBlocks(sh);
-  OctBuffer *buf;
-  Cube cube;
   uint64_t ret=0;
-  int i,j;
-  for (i=0;i<blockList.size();i++)
+  octRoot.visitNodes(sh,[&ret](Octree &node)
   {
-    buf=getBlock(blockList[i]);
-    if (buf->points.size())
-      cube=octRoot.findCube(buf->points[0].location);
-    if (sh.in(cube))
+    ret+=node.getCount();
+  },[this,&sh,&ret](int64_t block,bool inside)
+  {
+    OctBuffer *buf=getBlock(block);
+    int j;
+    if (inside)
       ret+=buf->points.size();
     else
       for (j=0;j<buf->points.size();j++)
 	if (sh.in(buf->points[j].location))
 	  ret++;
-  }
+  });
   return ret;
 }
 
@@ -1269,15 +2354,26 @@ array<double,2> OctStore::hiLoPointsIn(const Shape &sh)
  * Caller is responsible for disowning.
  */
 {
-  vector<int64_t> blockList=octRoot.findBlocks(sh);
-  OctBuffer *buf;
   double hi=-INFINITY,lo=INFINITY;
   array<double,2> ret;
-  int i,j;
-  for (i=0;i<blockList.size();i++)
+  octRoot.visitNodes(sh,[&hi,&lo](Octree &node)
   {
-    buf=getBlock(blockList[i]);
-    if (buf->getLow()<lo || buf->getHigh()>hi)
+    if (node.getStats().getHigh()>hi)
+      hi=node.getStats().getHigh();
+    if (node.getStats().getLow()<lo)
+      lo=node.getStats().getLow();
+  },[this,&sh,&hi,&lo](int64_t block,bool inside)
+  {
+    OctBuffer *buf=getBlock(block);
+    int j;
+    if (inside)
+    {
+      if (buf->getHigh()>hi)
+	hi=buf->getHigh();
+      if (buf->getLow()<lo)
+	lo=buf->getLow();
+    }
+    else if (buf->getLow()<lo || buf->getHigh()>hi)
       for (j=0;j<buf->points.size();j++)
 	if (sh.in(buf->points[j].location))
 	{
@@ -1286,24 +2382,31 @@ array<double,2> OctStore::hiLoPointsIn(const Shape &sh)
 	  if (buf->points[j].location.elev()<lo)
 	    lo=buf->points[j].location.elev();
 	}
-  }
+  });
   ret[0]=lo;
   ret[1]=hi;
   return ret;
 }
 
 void OctStore::split(int64_t block,xyz camelStraw)
+/* Partitions the block's points among the octants of its cube and puts
+ * them straight into the eight child blocks while holding the cube's lock.
+ * The octant with the most points keeps the block number; the others get
+ * new blocks, which are filled before the octree shows them, so no other
+ * thread can put points in them first. Empty octants get no block.
+ */
 {
-  vector<LasPoint> tempPoints;
-  OctBuffer *currentBlock;
+  vector<LasPoint> tempPoints,childPoints[8];
+  int64_t childBlock[8];
+  PointTally tally;
+  OctBuffer *currentBlock,*childBuf;
   Cube thisCube;
-  int i,fullth;
+  xyz ctr;
+  int i,j,keep,oldScaling;
   bool gotCubeLock=false;
   while (!gotCubeLock)
   {
-    setBlockMutex.lock_shared();
     gotCubeLock=lockCube(thisCube=octRoot.findCube(camelStraw));
-    setBlockMutex.unlock_shared();
     if (!gotCubeLock)
     {
       unlockCube();
@@ -1315,21 +2418,41 @@ void OctStore::split(int64_t block,xyz camelStraw)
 #if DEBUG_STORE
   cout<<"Splitting block "<<block<<endl;
 #endif
-  fullth=0;
+  ctr=thisCube.getCenter();
   currentBlock->blockMutex.lock();
-  tempPoints=currentBlock->points;
-  currentBlock->markDirty();
-  for (i=0;i<currentBlock->points.size();i++)
+  tempPoints.swap(currentBlock->points);
+  oldScaling=currentBlock->scaling;
+  for (i=0;i<tempPoints.size();i++)
   {
-    if (currentBlock->points[i].location.isfinite())
-      ++fullth;
+    tally.add(tempPoints[i]);
+    j=(tempPoints[i].location.getz()>=ctr.getz())*4+
+      (tempPoints[i].location.gety()>=ctr.gety())*2+
+      (tempPoints[i].location.getx()>=ctr.getx());
+    childPoints[j].push_back(tempPoints[i]);
   }
-  currentBlock->points.clear();
-  currentBlock->high=-INFINITY;
-  currentBlock->low=INFINITY;
+  for (keep=0,j=1;j<8;j++)
+    if (childPoints[j].size()>childPoints[keep].size())
+      keep=j;
   currentBlock->blockMutex.unlock();
-  octRoot.split(camelStraw);
-  embufferPoints(tempPoints,thisThread());
+  setBlockMutex.lock();
+  unsave();
+  for (j=0;j<8;j++)
+    if (j==keep)
+      childBlock[j]=block;
+    else if (childPoints[j].size())
+      childBlock[j]=nBlocks++;
+    else
+      childBlock[j]=-1;
+  setBlockMutex.unlock();
+  for (j=0;j<8;j++)
+    if (childBlock[j]>=0)
+    {
+      childBuf=(j==keep)?currentBlock:getBlock(childBlock[j]);
+      // If the block's points didn't all fit one scaling, those in one octant may.
+      childBuf->fill(childPoints[j],commonScaling(childPoints[j],oldScaling));
+      updateCount(childBlock[j],childBuf->points.size());
+    }
+  octRoot.split(camelStraw,childBlock,tally);
   logEndSplit(currentBlock->bufferNumber,block);
 #if DEBUG_STORE
   cout<<"Block "<<block<<" is split\n";
@@ -26,32 +26,155 @@
 #include <vector>
 #include <deque>
 #include <set>
+#include <array>
+#include <atomic>
 #include "config.h"
 #include "shape.h"
 #include "las.h"
 #include "threads.h"
 #include "ps.h"
+#include "blockfile.h"
+#include "evict.h"
+#include "chunktable.h"
+#include "ramtier.h"
+#include "mortonindex.h"
 
 #ifdef WAVEFORM
 #define LASPOINT_SIZE 91
 #define RECORDS 720
+#define QPOINT_SIZE 69
+#define QRECORDS 949
 #define BLOCKSIZE 65536
 #else
 #define LASPOINT_SIZE 61
 #define RECORDS 537
+#define QPOINT_SIZE 40
+#define QRECORDS 818
 #define BLOCKSIZE 32768
 #endif
+#define KEY_SLOTS 2048
 /* If a future version of LAS adds more fields, making the size of LasPoint
  * on disk bigger, these should be changed so that LASPOINT_SIZE*RECORDS is
  * equal to or slightly smaller than BLOCKSIZE, which is a power of 2 at least
- * 4096, and RECORDS<=1000.
+ * 4096, and RECORDS<=1000. QRECORDS is the number of points in a quantized
+ * block: QUANT_HEADER_SIZE+QPOINT_SIZE*QRECORDS must be less than BLOCKSIZE.
+ * KEY_SLOTS is the size of a buffer's hash index of locations, a power of 2
+ * at least twice QRECORDS.
  */
+
+/* Blocks are stored in two size classes, each in its own files. A leaf
+ * is written in a small slot as long as its points fit, and moves to a
+ * full-size slot when they don't, so that sparse leaves at the edges of
+ * the cloud don't fill the files and the page cache with padding.
+ */
+#define SMALL_BLOCKSIZE 4096
+#define BLOCK_CLASSES 2
+extern const int classSize[BLOCK_CLASSES];
+
+/* The last byte of a block tells how it is encoded. A block that has
+ * never been written is all zeros.
+ */
+#define BLOCK_NEW 0
+#define BLOCK_DOUBLE 1
+#define BLOCK_QUANT 2
+#define QUANT_HEADER_SIZE 15
+#define MAX_SCALINGS 256
+/* A store can be saved after reading the point cloud and reopened by a
+ * later run on the same files. The index file has the block files' name
+ * with "i" appended.
+ */
+#define STORE_INDEX_MAGIC "Wolkenbase store index"
+#define STORE_INDEX_VERSION 2
+/* When more than DIRTY_HIGH of the buffers are dirty, the flusher thread
+ * writes them back until no more than DIRTY_LOW are dirty.
+ */
+#define DIRTY_HIGH 0.25
+#define DIRTY_LOW 0.125
+// Tables of buffers, indexed by buffer number, and of blocks, indexed by block number
+#define BUFFER_CHUNK_BITS 12
+#define BUFFER_MAXCHUNKS 4096
+#define BLOCK_CHUNK_BITS 16
+#define BLOCK_MAXCHUNKS 65536
 //#define shared_mutex mutex
 //#define lock_shared lock
 //#define unlock_shared unlock
+/* Classes below NODE_CLASSES-1 are counted separately in the octree's
+ * aggregates; the rest are counted together in the last.
+ */
+#define NODE_CLASSES 32
+/* A node with at least LOD_MIN_POINTS points can keep a sample of up to
+ * LOD_SAMPLES of them, one in each of LOD_SAMPLES cells of its cube (two
+ * levels of octants, then quadrants), for drawing at low resolution.
+ */
+#define LOD_SAMPLES 256
+#define LOD_MIN_POINTS 65536
 
 class OctStore;
 
+struct LodSample
+/* In each cell, the point whose location hashes lowest, so that the sample
+ * doesn't depend on the order the points were put in, and a node's sample
+ * can be made from its children's.
+ */
+{
+  uint64_t changes; // the node's changes when the sample was made
+  uint64_t hash[LOD_SAMPLES]; // ~0 if the cell is empty
+  xyz location[LOD_SAMPLES];
+  unsigned short classification[LOD_SAMPLES];
+  LodSample();
+  void offer(int cell,const LasPoint &pnt);
+};
+
+struct PointTally
+// Some points, or a change in them, to add to the octree's aggregates
+{
+  int64_t count;
+  double low,high;
+  int64_t classes[NODE_CLASSES];
+  PointTally();
+  void add(const LasPoint &pnt,int sign=1);
+};
+
+class NodeStats
+/* Totals of the points in a subtree, kept up to date as points are put,
+ * so that a query covering the whole subtree needn't read its blocks.
+ * The elevation range only widens, since points are never removed, only
+ * replaced by points at the same location.
+ */
+{
+public:
+  NodeStats();
+  void add(const PointTally &t);
+  void clear();
+  void write(std::ostream &file) const;
+  void read(std::istream &file);
+  uint64_t getCount() const
+  {
+    return count.load(std::memory_order_relaxed);
+  }
+  double getLow() const
+  {
+    return low.load(std::memory_order_relaxed);
+  }
+  double getHigh() const
+  {
+    return high.load(std::memory_order_relaxed);
+  }
+  uint64_t getClass(int c) const
+  {
+    return classes[c].load(std::memory_order_relaxed);
+  }
+  uint64_t getChanges() const
+  {
+    return changes.load(std::memory_order_relaxed);
+  }
+private:
+  std::atomic<uint64_t> changes; // number of tallies added, to tell when a sample is stale
+  std::atomic<uint64_t> count;
+  std::atomic<double> low,high;
+  std::atomic<uint64_t> classes[NODE_CLASSES];
+};
+
 class Octree
 {
 public:
@@ -61,9 +184,13 @@ public:
   int64_t findBlock(xyz pnt);
   Cube findCube(xyz pnt);
   std::vector<int64_t> findBlocks(const Shape &sh);
+  template <typename S,typename F> void visitBlocks(const S &sh,F f,bool inside=false);
+  template <typename S,typename N,typename F> void visitNodes(const S &sh,N fnode,F f,bool inside=false);
   void setBlock(xyz pnt,int64_t blk);
   void sizeFit(std::vector<xyz> pnts);
-  void split(xyz pnt);
+  void split(xyz pnt,const int64_t childBlock[8],const PointTally &tally);
+  void setLeaf(xyz pnt,int64_t blk,int depth);
+  uint64_t mortonCode(xyz pnt);
   xyz getCenter()
   {
     return center;
@@ -74,19 +201,98 @@ public:
   }
   Cube cube(int n=-1);
   int dump(std::ofstream &file);
-  void plot(PostScript &ps);
+  void samplePoints(const Shape &sh,double spacing,std::vector<LasPoint> &pnts,bool inside=false);
+  void save(std::ostream &file);
+  void load(std::istream &file);
+  void addTally(xyz pnt,const PointTally &tally);
+  const NodeStats &getStats()
+  {
+    return stats;
+  }
   uint64_t getCount()
   {
-    return count;
+    return stats.getCount();
   }
-  void countPoints(unsigned int n);
 private:
   xyz center;
   double side;
-  uintptr_t sub[8]; // Even means Octree *; odd means a disk block.
-  uint64_t count;
+  std::atomic<uintptr_t> sub[8]; // Even means Octree *; odd means a disk block.
+  NodeStats stats;
+  LodSample *sample; // nullptr until asked for
+  MortonIndex *linear; // only in the root
+  LodSample *getSample();
+  void offerPoints(LodSample &s,xyz ctr,double sd);
+  void setBlock(xyz pnt,int64_t blk,MortonIndex *index,uint64_t key);
+  void split(xyz pnt,const int64_t childBlock[8],const PointTally &tally,MortonIndex *index,uint64_t key);
+  void setLeaf(xyz pnt,int64_t blk,int depth,MortonIndex *index,uint64_t key);
+  void saveNode(std::ostream &file);
+  void loadNode(std::istream &file,MortonIndex *index,uint64_t key);
 };
 
+template <typename S,typename F> void Octree::visitBlocks(const S &sh,F f,bool inside)
+/* Calls f(block,inside) for every block whose cube intersects sh, where
+ * inside tells whether the cube is entirely in sh, so that f needn't test
+ * each point. Each cube is tested once, and the cubes under a cube that
+ * is inside aren't tested at all.
+ */
+{
+  int i;
+  bool in;
+  uintptr_t subi;
+  Cube c;
+  for (i=0;i<8;i++)
+  {
+    subi=sub[i].load(std::memory_order_acquire);
+    if (subi)
+    {
+      in=inside;
+      if (!in)
+      {
+	c=cube(i);
+	if (!sh.intersect(c))
+	  continue;
+	in=sh.in(c);
+      }
+      if (subi&1)
+	f((int64_t)(subi>>1),in);
+      else
+	((Octree *)subi)->visitBlocks(sh,f,in);
+    }
+  }
+}
+
+template <typename S,typename N,typename F> void Octree::visitNodes(const S &sh,N fnode,F f,bool inside)
+/* Like visitBlocks, but calls fnode(node) for each subtree entirely in sh,
+ * instead of visiting its blocks, so that f can use its aggregates.
+ */
+{
+  int i;
+  bool in;
+  uintptr_t subi;
+  Cube c;
+  for (i=0;i<8;i++)
+  {
+    subi=sub[i].load(std::memory_order_acquire);
+    if (subi)
+    {
+      in=inside;
+      if (!in)
+      {
+	c=cube(i);
+	if (!sh.intersect(c))
+	  continue;
+	in=sh.in(c);
+      }
+      if (subi&1)
+	f((int64_t)(subi>>1),in);
+      else if (in)
+	fnode(*(Octree *)subi);
+      else
+	((Octree *)subi)->visitNodes(sh,fnode,f,in);
+    }
+  }
+}
+
 extern Octree octRoot;
 extern OctStore octStore;
 extern double lowRam;
@@ -98,7 +304,7 @@ public:
   OctBuffer();
   void write();
   void markDirty();
-  void own();
+  bool own();
   bool ownAlone();
   bool iOwn();
   void read(int64_t block);
@@ -108,6 +314,10 @@ public:
   void shrink();
   LasPoint get(xyz key);
   bool put(LasPoint pnt);
+  int capacity()
+  {
+    return scaling>=0?QRECORDS:RECORDS;
+  }
   std::map<int,size_t> countClasses();
   uint64_t countPoints()
   {
@@ -118,7 +328,6 @@ public:
     return points;
   }
   int dump(std::ofstream &file,Cube cube);
-  void plot(PostScript &ps,Cube cube);
   double getLow()
   {
     return low;
@@ -129,18 +338,28 @@ public:
   }
   //bool isConsistent();
 private:
-  bool dirty; // The contents of the buffer may differ from the contents of the block.
-  bool inTransit; // The correspondence between buffer and block is being changed.
+  void decode(const char *block,int size);
+  void encode(char *block,int size);
+  void compact(std::vector<char> &bytes);
+  void fill(std::vector<LasPoint> &pnts,int sc);
+  int sizeClass();
+  void indexPoints();
+  void indexPoint(int n);
+  int findPoint(xyz key);
+  std::atomic<bool> dirty; // The contents of the buffer may differ from the contents of the block.
+  std::atomic<bool> inTransit; // The correspondence between buffer and block is being changed.
   int bufferNumber;
+  int scaling; // index into store's scalings if all points are quantizable, else -1
   int64_t blockNumber;
-  int64_t lastUsed;
   double low,high;
   std::set<int> owningThread;
   std::vector<LasPoint> points;
+  std::vector<unsigned short> keySlots; // index into points plus 1, or 0 if empty
   std::shared_mutex blockMutex;
   std::mutex ownMutex; // lock when owning or disowning blocks
   OctStore *store;
   friend class OctStore;
+  friend class Octree;
 };
 
 class OctStore
@@ -163,14 +382,31 @@ public:
   {
     return nBlocks;
   }
-  void open(std::string fileName,int numFiles=1);
+  void setEvictPolicy(int policy);
+  void setDirtyMarks(double low,double high);
+  void setRamTier(double bytes);
+  size_t ramTierSize()
+  {
+    return ramTier.size();
+  }
+  bool tooDirty();
+  int writeBehind();
+  void open(std::string fileName,int numFiles=1,int mode=STORE_DEFAULT,bool keep=false);
+  void save(const std::vector<std::string> &sources);
+  bool resume(const std::vector<std::string> &sources);
+  int addScaling(const LasScaling &sc);
   void close();
   LasPoint get(xyz key);
   void put(LasPoint pnt,bool splitting=false);
+  bool fitsBlock(const std::vector<LasPoint> &pnts);
+  int64_t newLeaf(xyz pnt,int depth,std::vector<LasPoint> &pnts);
+  bool prefetch(int64_t block);
+  void addThreads(int n);
   std::map<int,size_t> countClasses(int64_t block);
   std::vector<LasPoint> getAll(int64_t block);
   void dump(std::ofstream &file);
-  void plot(PostScript &ps);
+  void plot(PostScript &ps,double spacing=0);
+  std::vector<LasPoint> samplePointsIn(const Shape &sh,double spacing);
   void setIgnoreDupes(bool ig);
   void dumpBuffers();
   bool isConsistent();
@@ -178,18 +414,33 @@ public:
   uint64_t countPointsIn(const Shape &sh);
   std::array<double,2> hiLoPointsIn(const Shape &sh);
   uint64_t countPoints();
-  std::shared_mutex setBlockMutex; // lock when adding new blocks to file
+  std::mutex setBlockMutex; // lock when adding new blocks to the octree or splitting; lookups don't lock
+  std::mutex sampleMutex; // lock when making or reading nodes' samples
 private:
-  std::map<int,std::fstream> file;
-  std::map<int,std::mutex> fileMutex; // lock when read/writing file
-  std::shared_mutex nowUsedMutex; // lock when updating nowUsed
+  std::map<int,BlockFile> file[BLOCK_CLASSES];
+  std::string storeName;
+  int storeFiles,storeMode; // as passed to open
+  std::atomic<bool> saved; // The index file matches the block files.
+  void unsave();
+  void forgetBuffers();
+  std::array<LasScaling,MAX_SCALINGS> scalings;
+  std::atomic<int> nScalings;
+  std::mutex scalingMutex; // lock when adding a scaling
+  int findScaling(const LasPoint &pnt);
+  bool inScaling(const LasPoint &pnt,int sc);
+  int commonScaling(const std::vector<LasPoint> &pnts,int sc=-1);
   std::recursive_mutex splitMutex; // lock when splitting
-  std::shared_mutex revMutex; // lock when changing revBlocks
-  std::mutex transitMutex; // lock when setting or clearing inTransit
-  std::shared_mutex bufferMutex; // lock when adding new buffers to store
+  std::mutex bufferMutex; // lock when adding new buffers to store
   std::mutex countMutex; // lock when growing blockPointCount and blockGroupCount
-  int64_t nowUsed;
-  uint64_t clockNum,clockDen;
+  std::mutex loadMutex; // lock when changing loadingBlocks
+  std::atomic<int> nDirty;
+  double dirtyLow,dirtyHigh;
+  int evictPolicy;
+  LruEvictor lruEvictor;
+  ClockEvictor clockEvictor;
+  RamTier ramTier;
+  double ramTierLimit; // bytes; negative means lowRam
+  void stash(OctBuffer *buf,double fram);
   int nFiles;
   uint32_t blockGroup;
   bool ignoreDupes;
@@ -199,9 +450,26 @@ private:
   void updateCount(int64_t block,int nPoints);
   OctBuffer *getBlock(int64_t block,bool mustExist=false);
   OctBuffer *getBlock(xyz key,bool writing);
-  std::map<int,OctBuffer> blocks; // buffer number -> block
-  std::map<int,int> revBlocks; // block number -> buffer number
-  std::multimap<int64_t,int> lastUsedMap; // time counter -> buffer number
+  ChunkTable<std::atomic<OctBuffer *>,BUFFER_CHUNK_BITS,BUFFER_MAXCHUNKS> blocks; // buffer number -> buffer
+  ChunkTable<std::atomic<int>,BLOCK_CHUNK_BITS,BLOCK_MAXCHUNKS> revBlocks; // block number -> buffer number+1, 0 if none
+  OctBuffer *getBuffer(int n)
+  {
+    return blocks[n].load(std::memory_order_acquire);
+  }
+  int bufferOf(int64_t block);
+  void setBufferOf(int64_t block,int buf);
+  OctBuffer *findBuffer(int64_t block,int &bufnum);
+  OctBuffer *addBuffer(bool owned);
+  ChunkTable<std::atomic<uint64_t>,BLOCK_CHUNK_BITS,BLOCK_MAXCHUNKS> blockSlot; // block number -> class<<56|slot+1, 0 if never written
+  std::mutex slotMutex; // lock when allocating or freeing slots
+  int64_t nSlots[BLOCK_CLASSES];
+  std::vector<int64_t> freeSlots[BLOCK_CLASSES];
+  uint64_t getSlot(int64_t block);
+  uint64_t moveSlot(int64_t block,int cls);
+  char *slotAddress(uint64_t slotWord);
+  void readSlot(uint64_t slotWord,char *buf);
+  void writeSlot(uint64_t slotWord,const char *buf);
+  std::set<int64_t> loadingBlocks; // blocks being read or written back
   std::map<int,std::vector<int> > ownMap; // thread -> buffer number
   std::deque<uint16_t> blockPointCount; // block number -> number of points
   std::deque<uint32_t> blockGroupCount; // 256 blocks group -> total number of points
@@ -0,0 +1,92 @@
+/******************************************************/
+/*                                                    */
+/* ramtier.cpp - compressed blocks kept in RAM        */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ramtier.h"
+using namespace std;
+
+RamTier::RamTier()
+{
+  nBytes=0;
+}
+
+void RamTier::dropOldest()
+// Call with tierMutex locked.
+{
+  unordered_map<int64_t,TierBlock>::iterator i;
+  i=blocks.find(order.front());
+  order.pop_front();
+  nBytes-=i->second.bytes.size();
+  blocks.erase(i);
+}
+
+void RamTier::put(int64_t block,vector<char> &bytes,size_t limit)
+/* Takes the bytes (leaving bytes empty) and drops old blocks until
+ * everything fits in limit. If the block alone is bigger than limit,
+ * it isn't kept.
+ */
+{
+  tierMutex.lock();
+  while (order.size() && nBytes+bytes.size()>limit)
+    dropOldest();
+  if (nBytes+bytes.size()<=limit && !blocks.count(block))
+  {
+    nBytes+=bytes.size();
+    order.push_back(block);
+    blocks[block].bytes.swap(bytes);
+    blocks[block].pos=prev(order.end());
+  }
+  tierMutex.unlock();
+}
+
+bool RamTier::take(int64_t block,vector<char> &bytes)
+{
+  unordered_map<int64_t,TierBlock>::iterator i;
+  bool ret=false;
+  tierMutex.lock();
+  i=blocks.find(block);
+  if (i!=blocks.end())
+  {
+    bytes.swap(i->second.bytes);
+    nBytes-=bytes.size();
+    order.erase(i->second.pos);
+    blocks.erase(i);
+    ret=true;
+  }
+  tierMutex.unlock();
+  return ret;
+}
+
+void RamTier::shrink(size_t limit)
+{
+  tierMutex.lock();
+  while (order.size() && nBytes>limit)
+    dropOldest();
+  tierMutex.unlock();
+}
+
+void RamTier::clear()
+{
+  tierMutex.lock();
+  blocks.clear();
+  order.clear();
+  nBytes=0;
+  tierMutex.unlock();
+}
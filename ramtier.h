@@ -0,0 +1,63 @@
+/******************************************************/
+/*                                                    */
+/* ramtier.h - compressed blocks kept in RAM          */
+/*                                                    */
+/******************************************************/
+/* Copyright 2023 Pierre Abbat.
+ * This file is part of Wolkenbase.
+ *
+ * Wolkenbase is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Wolkenbase is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Wolkenbase. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RAMTIER_H
+#define RAMTIER_H
+#include <unordered_map>
+#include <list>
+#include <vector>
+#include <cstdint>
+#include "threads.h"
+
+struct TierBlock
+{
+  std::vector<char> bytes;
+  std::list<int64_t>::iterator pos; // in RamTier::order
+};
+
+class RamTier
+/* Blocks evicted from buffers, encoded as compactly as on disk but
+ * without padding: a quantized point takes 40 bytes instead of about
+ * 100 in a buffer. The blocks have already been written, so any of them
+ * can be dropped at any time; the oldest are dropped first when the tier
+ * is full. A block taken out of the tier goes back into a buffer, where
+ * it may be changed, so the tier doesn't keep it.
+ */
+{
+public:
+  RamTier();
+  void put(int64_t block,std::vector<char> &bytes,size_t limit);
+  bool take(int64_t block,std::vector<char> &bytes);
+  void shrink(size_t limit);
+  void clear();
+  size_t size()
+  {
+    return nBytes;
+  }
+private:
+  std::mutex tierMutex;
+  std::unordered_map<int64_t,TierBlock> blocks;
+  std::list<int64_t> order; // oldest first
+  size_t nBytes;
+  void dropOldest();
+};
+#endif
@@ -21,6 +21,7 @@
  */
 #include <queue>
 #include <set>
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <atomic>
@@ -42,14 +43,17 @@ using namespace std;
 namespace cr=std::chrono;
 
 #define CHUNKSIZE 137
+// Number of chunks read before their points are sent to the threads' buffers
+#define ROUTE_CHUNKS 16
 
 mutex actMutex;
 mutex startMutex;
 mutex anyThreadMutex;
-map<int,mutex> pointBufferMutex,cubeMutex;
+map<int,mutex> pointBufferMutex;
 shared_mutex threadStatusMutex;
 mutex tileDoneMutex;
 mutex classTotalMutex;
+mutex rangeMutex;
 
 atomic<int> threadCommand;
 vector<thread> threads;
@@ -62,8 +66,7 @@ queue<Eisenstein> tileDoneQueue;
 map<int,vector<LasPoint> > pointBuffer;
 map<int,size_t> pbsz,classTotals;
 map<int,int> bufferPos;
-map<int,map<int,Cube> > lockedCubes,readLockedCubes;
-vector<Cube> heldCubes; // Used in unlockCube to know which mutexes to get
+map<LasHeader *,int> rangesLeft; // ranges of each file not yet read
 int currentAction;
 map<thread::id,int> threadNums;
 Flowsnake snake;
@@ -90,26 +93,21 @@ double busyFraction()
 
 void startThreads(int n)
 {
-  int i,m;
+  int i;
   threadCommand=TH_WAIT;
   openThreadLog();
   logStartThread();
   sleepTime.resize(n);
-  m=n*3;
   threadNums[this_thread::get_id()]=-1;
-  heldCubes.resize(n);
-  for (i=0;i<m;i++)
-  {
-    cubeMutex[i];
-    lockedCubes[i];
-    readLockedCubes[i];
-  }
+  octStore.addThreads(n);
   for (i=0;i<n;i++)
   {
     threads.push_back(thread(WolkenThread(),i));
     sleepTime[i]=i+1;
     this_thread::sleep_for(chrono::milliseconds(10));
   }
+  threads.push_back(thread(PrefetchThread(),n));
+  threads.push_back(thread(FlushThread(),n+1));
 }
 
 void joinThreads()
@@ -202,9 +200,7 @@ void embufferPoint(LasPoint point,bool fromFile)
 {
   int thread;
   static int anyThread=0;
-  octStore.setBlockMutex.lock_shared();
   thread=octRoot.findBlock(point.location);
-  octStore.setBlockMutex.unlock_shared();
   if (thread<0)
   {
     anyThreadMutex.lock();
@@ -228,21 +224,61 @@ void embufferPoint(LasPoint point,bool fromFile)
     this_thread::sleep_for(chrono::milliseconds(1));
 }
 
-void embufferPoints(vector<LasPoint> points,int thread)
-/* Puts a whole block of points from a split block at the end of the thread's
- * buffer, without shuffling. Usually, most of them will be reembuffered to
- * other threads' buffers.
+void embufferPoints(const vector<LasPoint> &points,bool fromFile)
+/* Same as calling embufferPoint for each point, but sorts the points by
+ * thread first, so that each thread's buffer is locked once. Each batch
+ * is shuffled into its buffer with one relprime step, instead of one per
+ * point.
  */
 {
-  int i;
-  if (thread<0)
-    thread+=threadStatus.size();
-  pointBufferMutex[thread].lock();
-  pointBuffer[thread].reserve(pointBuffer[thread].size()+points.size());
+  static thread_local vector<vector<LasPoint> > parts;
+  static thread_local vector<int> routes;
+  static int anyThread=0;
+  int thread,nThreads=threadStatus.size();
+  size_t i,oldSize,newSize,step;
+  int nUnrouted=0;
+  if (parts.size()<nThreads)
+    parts.resize(nThreads);
+  routes.resize(points.size());
   for (i=0;i<points.size();i++)
-    pointBuffer[thread].push_back(points[i]);
-  pbsz[thread]=pointBuffer[thread].size();
-  pointBufferMutex[thread].unlock();
+    if ((routes[i]=octRoot.findBlock(points[i].location))<0)
+      nUnrouted++;
+  if (nUnrouted)
+  {
+    anyThreadMutex.lock();
+    thread=anyThread;
+    anyThread=((anyThread-nUnrouted)%nThreads+nThreads)%nThreads;
+    anyThreadMutex.unlock();
+    for (i=0;i<points.size();i++)
+      if (routes[i]<0)
+      {
+	routes[i]=thread;
+	if (--thread<0)
+	  thread+=nThreads;
+      }
+  }
+  for (i=0;i<points.size();i++)
+    if (!points[i].location.isnan())
+      parts[routes[i]%nThreads].push_back(points[i]);
+  for (thread=0;thread<nThreads;thread++)
+    if (parts[thread].size())
+    {
+      pointBufferMutex[thread].lock();
+      vector<LasPoint> &buf=pointBuffer[thread];
+      oldSize=buf.size();
+      buf.insert(buf.end(),parts[thread].begin(),parts[thread].end());
+      newSize=pbsz[thread]=buf.size();
+      step=relprime(newSize);
+      for (i=oldSize;i<newSize;i++)
+      {
+	bufferPos[thread]=(bufferPos[thread]+step)%newSize;
+	swap(buf[i],buf[bufferPos[thread]]);
+      }
+      pointBufferMutex[thread].unlock();
+      parts[thread].clear();
+    }
+  while (fromFile && pointBufferSize()*sizeof(LasPoint)>lowRam)
+    this_thread::sleep_for(chrono::milliseconds(1));
 }
 
 LasPoint debufferPoint(int thread)
@@ -423,18 +459,30 @@ int nThreads()
 }
 
 void countClasses(int thread)
+/* The octree's aggregates have the count of each class, unless there are
+ * classes too high to have their own counts, in which case the blocks are
+ * counted.
+ */
 {
   map<int,size_t> threadTotals,blockCounts;
   int i;
   map<int,size_t>::iterator j;
+  const NodeStats &rootStats=octRoot.getStats();
   if (thread==0) // Count points read in from XYZ or PLY as raw in LASify
     threadTotals[0]=cloud.size();
-  for (i=thread;i<octStore.getNumBlocks();i+=nThreads())
+  if (rootStats.getClass(NODE_CLASSES-1)==0)
   {
-    blockCounts=octStore.countClasses(i);
-    for (j=blockCounts.begin();j!=blockCounts.end();++j)
-      threadTotals[j->first]+=j->second;
+    for (i=0;thread==0 && i<NODE_CLASSES-1;i++)
+      if (rootStats.getClass(i))
+	threadTotals[i]+=rootStats.getClass(i);
   }
+  else
+    for (i=thread;i<octStore.getNumBlocks();i+=nThreads())
+    {
+      blockCounts=octStore.countClasses(i);
+      for (j=blockCounts.begin();j!=blockCounts.end();++j)
+	threadTotals[j->first]+=j->second;
+    }
   while (actQueue.size())
     sleep(thread); // Make sure that each thread runs one countClasses instance
   classTotalMutex.lock();
@@ -445,13 +493,14 @@ void countClasses(int thread)
 
 void WolkenThread::operator()(int thread)
 {
-  long long h=0,i=0,j=0,n,nPoints=0,nChunks;
+  long long h=0,i=0,j=0,k,n,nPoints=0,nChunks,firstChunk,nRanges;
   long long blknum;
-  bool dropZeros;
+  bool dropZeros,lastRange;
   xyz offset,scale;
   ThreadAction act;
   BoundRect br;
   LasPoint point,gotPoint;
+  vector<LasPoint> chunk;
   Eisenstein cylAddress;
   logStartThread();
   startMutex.lock();
@@ -484,20 +533,18 @@ void WolkenThread::operator()(int thread)
 	   */
 	  if (act.hdr->isZipped())
 	    act.hdr->reopenLaz();
+	  octStore.addScaling(act.hdr->getScaling());
 	  try
 	  {
 	    dropZeros=false;
-	    i=n=0;
-	    h=relprime(act.hdr->numberPoints(),thread);
-	    for (i=0;i<100;i++)
-	    {
-	      point=act.hdr->readPoint(n);
-	      if (point.returnNum)
+	    chunk.clear();
+	    act.hdr->readPoints(0,100,chunk);
+	    for (i=0;i<chunk.size();i++)
+	      if (chunk[i].returnNum)
 	      {
 		dropZeros=true;
 		break;
 	      }
-	    }
 	  }
 	  catch (...)
 	  {
@@ -513,31 +560,69 @@ void WolkenThread::operator()(int thread)
 	    cout<<" Dropping zeros\n";
 	  else
 	    cout<<" Keeping zeros\n";
+	  /* Split the file into one range of chunks per worker thread. This
+	   * thread reads the first range; the others are queued for any thread.
+	   */
+	  nChunks=(act.hdr->numberPoints()+CHUNKSIZE-1)/CHUNKSIZE;
+	  nRanges=threadStatus.size();
+	  if (nRanges>nChunks)
+	    nRanges=nChunks;
+	  if (nRanges<1)
+	    nRanges=1;
+	  act.param1=nRanges;
+	  act.flags=dropZeros;
+	  rangeMutex.lock();
+	  rangesLeft[act.hdr]=nRanges;
+	  rangeMutex.unlock();
+	  for (i=1;i<nRanges;i++)
+	  {
+	    act.opcode=ACT_READ_RANGE;
+	    act.param0=i;
+	    enqueueAction(act);
+	  }
+	  act.param0=0;
+	  // fall through
+	case ACT_READ_RANGE:
+	  /* Read one range of chunks of the file with this thread's own
+	   * stream, in shuffled order, while putting points in the octree.
+	   */
+	  nRanges=act.param1;
+	  dropZeros=act.flags;
 	  nChunks=(act.hdr->numberPoints()+CHUNKSIZE-1)/CHUNKSIZE;
-	  h=relprime(nChunks,thread);
+	  firstChunk=nChunks*act.param0/nRanges;
+	  nChunks=nChunks*(act.param0+1)/nRanges-firstChunk;
+	  // Decompressing a LAZ file out of order would mean seeking for every chunk.
+	  h=act.hdr->isZipped()?1:relprime(nChunks,thread);
+	  j=n=0;
 	  try
 	  {
+	    PointReader rangeReader(*act.hdr);
 	    while (j<nChunks && threadCommand!=TH_STOP)
 	    {
 	      if (pointBufferSize()*sizeof(point)<lowRam)
-	      {
-		if (n*CHUNKSIZE+i<act.hdr->numberPoints())
-		{
-		  point=act.hdr->readPoint(n*CHUNKSIZE+i);
-		  if (point.returnNum==0 && !dropZeros)
-		    point.returnNum=1;
-		  if (point.returnNum)
-		    embufferPoint(point,false); // It is from file, but sleeping is handled here.
-		}
-		i++;
-		if (i==CHUNKSIZE)
+	      { // Read several chunks, then send their points to the threads.
+		chunk.clear();
+		for (k=0;k<ROUTE_CHUNKS && j<nChunks;k++)
 		{
-		  i=0;
+		  rangeReader.readPoints((firstChunk+n)*CHUNKSIZE,CHUNKSIZE,chunk);
 		  j++;
 		  n=(n+h)%nChunks;
 		}
+		rangeMutex.lock();
+		act.hdr->addReadPoints(chunk.size());
+		rangeMutex.unlock();
+		for (i=k=0;i<chunk.size();i++)
+		{
+		  if (chunk[i].returnNum==0 && !dropZeros)
+		    chunk[i].returnNum=1;
+		  if (chunk[i].returnNum)
+		    chunk[k++]=chunk[i];
+		}
+		chunk.resize(k);
+		embufferPoints(chunk,false); // It is from file, but sleeping is handled here.
 	      }
-	      if (pointBuffersNonempty() || pointBufferSize()*sizeof(point)>lowRam || pointBufferSize()>65536)
+	      for (k=0;k<ROUTE_CHUNKS*CHUNKSIZE &&
+		   (pointBuffersNonempty() || pointBufferSize()*sizeof(point)>lowRam || pointBufferSize()>65536);k++)
 	      {
 		point=debufferPoint(thread);
 		if (point.isEmpty() && pointBufferSize()*sizeof(point)>lowRam)
@@ -562,7 +647,14 @@ void WolkenThread::operator()(int thread)
 	  {
 	    cerr<<"Error reading file\n";
 	  }
-	  act.hdr->close();
+	  // The last range to finish closes the file.
+	  rangeMutex.lock();
+	  lastRange=--rangesLeft[act.hdr]==0;
+	  if (lastRange)
+	    rangesLeft.erase(act.hdr);
+	  rangeMutex.unlock();
+	  if (lastRange)
+	    act.hdr->close();
 	  break;
       }
       point=debufferPoint(thread);
@@ -597,6 +689,7 @@ void WolkenThread::operator()(int thread)
       switch (act.opcode)
       {
 	case ACT_READ:
+	case ACT_READ_RANGE:
 	  cerr<<"Can't read a file in pause state\n";
 	  unsleep(thread);
 	  break;
@@ -693,3 +786,64 @@ void WolkenThread::operator()(int thread)
   //cout<<"Thread "<<thread<<" processed "<<nPoints<<" points\n";
   threadStatusMutex.unlock();
 }
+
+void PrefetchThread::operator()(int thread)
+/* While the worker threads scan or classify tiles in flowsnake order,
+ * reads the blocks of the next few tiles, so that the workers seldom
+ * have to wait for the disk. The post-scan phase looks only at tiles,
+ * not blocks, so there is nothing to read ahead then.
+ */
+{
+  vector<Eisenstein> tiles,lastTiles;
+  vector<int64_t> blockList;
+  int i,j,cmd,lastCmd=0;
+  bool didRead;
+  logStartThread();
+  startMutex.lock();
+  threadNums[this_thread::get_id()]=thread;
+  startMutex.unlock();
+  while (threadCommand!=TH_STOP)
+  {
+    cmd=threadCommand;
+    didRead=false;
+    if (cmd!=lastCmd)
+      lastTiles.clear();
+    lastCmd=cmd;
+    if (cmd==TH_SCAN || cmd==TH_SPLIT)
+    {
+      tiles=snake.peek(PREFETCH_TILES*nThreads());
+      for (i=0;i<tiles.size() && threadCommand==cmd;i++)
+	if (find(lastTiles.begin(),lastTiles.end(),tiles[i])==lastTiles.end())
+	{
+	  blockList=octRoot.findBlocks(snake.cyl(tiles[i]));
+	  for (j=0;j<blockList.size();j++)
+	    didRead|=octStore.prefetch(blockList[j]);
+	  octStore.disown();
+	}
+      lastTiles=tiles;
+    }
+    if (!didRead)
+      this_thread::sleep_for(chrono::milliseconds(1));
+  }
+}
+
+void FlushThread::operator()(int thread)
+/* Writes dirty buffers back to the file ahead of their being evicted,
+ * so that a worker thread that needs a buffer seldom waits for a write,
+ * and flushing the store between phases has little left to do.
+ */
+{
+  int nWritten;
+  logStartThread();
+  startMutex.lock();
+  threadNums[this_thread::get_id()]=thread;
+  startMutex.unlock();
+  while (threadCommand!=TH_STOP)
+  {
+    nWritten=0;
+    if (octStore.tooDirty())
+      nWritten=octStore.writeBehind();
+    if (!nWritten)
+      this_thread::sleep_for(chrono::milliseconds(1));
+  }
+}
@@ -62,10 +62,14 @@ class Flowsnake;
 #define ACT_COUNT 2
 #define ACT_WRITE 3
 #define ACT_LOAD 4
+#define ACT_READ_RANGE 5 // queued by ACT_READ for the other threads
 
 #define RES_LOAD_PLY 1
 #define RES_LOAD_XYZ 2
 
+// Number of tiles per worker thread whose blocks are read ahead
+#define PREFETCH_TILES 2
+
 struct ThreadAction
 {
   int opcode;
@@ -78,9 +82,6 @@ struct ThreadAction
   int result;
 };
 
-extern std::map<int,std::mutex> cubeMutex;
-extern std::map<int,std::map<int,Cube> > lockedCubes,readLockedCubes;
-extern std::vector<Cube> heldCubes;
 extern int currentAction;
 extern std::chrono::steady_clock clk;
 extern Flowsnake snake;
@@ -99,7 +100,7 @@ Eisenstein dequeueTileDone();
 bool tileDoneQueueEmpty();
 bool resultQueueEmpty();
 void embufferPoint(LasPoint point,bool fromFile);
-void embufferPoints(std::vector<LasPoint> points,int thread);
+void embufferPoints(const std::vector<LasPoint> &points,bool fromFile);
 LasPoint debufferPoint(int thread);
 size_t pointBufferSize();
 bool pointBufferEmpty();
@@ -118,4 +119,16 @@ public:
   void operator()(int thread);
 };
 
+class PrefetchThread
+{
+public:
+  void operator()(int thread);
+};
+
+class FlushThread
+{
+public:
+  void operator()(int thread);
+};
+
 #endif
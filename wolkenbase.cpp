@@ -72,7 +72,9 @@ int main(int argc, char *argv[])
     nthreads=thread::hardware_concurrency();
   if (nthreads<1)
     nthreads=2;
-  octStore.open("store.oct",nthreads+relprime(nthreads));
+  // Keep the store if it was saved, in case it's made from the same files.
+  octStore.open("store.oct",nthreads+relprime(nthreads),STORE_DEFAULT,
+		window.getKeepStore() && ifstream("store.octi").good());
   octStore.resize(8*nthreads+1);
   startThreads(nthreads);
   window.show();
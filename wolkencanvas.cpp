@@ -59,7 +59,7 @@ WolkenCanvas::WolkenCanvas(QWidget *parent):QWidget(parent)
   setBackgroundRole(QPalette::Base);
   setMinimumSize(40,30);
   setMouseTracking(true);
-  countedBlock=0;
+  resumed=keepStore=false;
   fileCountdown=splashScreenTime=dartAngle=ballAngle=0;
   lowRam=freeRam()/7;
 }
@@ -313,8 +313,6 @@ void WolkenCanvas::tick()
   pixmaxx=pixmaxy=0;
   while (elapsed<cr::milliseconds(timeLimit) && pixelsToPaint)
   {
-    countedBlock+=0x69969669;
-    octRoot.countPoints(countedBlock);
     pixel=peano.step();
     if (state==TH_READ || state==TH_WAIT)
       pcolor=pixelColorRead(pixel[0],pixel[1]);
@@ -500,15 +498,20 @@ void WolkenCanvas::startProcess(bool clfy)
       saveLaz=true;
     }
     waitForThreads(TH_READ);
+    sources.clear();
     for (i=0;i<inFileHeaders.size();i++)
     {
+      sources.push_back(inFileHeaders[i].fingerprint());
       limits.push_back(inFileHeaders[i].minCorner());
       limits.push_back(inFileHeaders[i].maxCorner());
       br.include(inFileHeaders[i].minCorner());
       br.include(inFileHeaders[i].maxCorner());
       sorter.insert(pair<int64_t,LasHeader *>(-inFileHeaders[i].numberPoints(),&inFileHeaders[i]));
     }
-    octRoot.sizeFit(limits);
+    // Only a fresh store can be replaced by a saved one.
+    resumed=keepStore && octStore.getNumBlocks()==0 && octStore.resume(sources);
+    if (!resumed)
+      octRoot.sizeFit(limits);
     side=br.right()-br.left();
     if (br.top()-br.bottom()>side)
       side=br.top()-br.bottom();
@@ -519,13 +522,19 @@ void WolkenCanvas::startProcess(bool clfy)
     snake.setSize(cube,tileSize);
     initTiles();
     shallClassify=clfy;
-    for (j=sorter.begin();j!=sorter.end();++j)
+    if (resumed)
     {
-      cout<<"Read file "<<baseName(j->second->getFileName())<<endl;
-      ta.hdr=j->second;
-      ta.opcode=ACT_READ;
-      enqueueAction(ta);
+      cout<<"Reusing store with "<<octStore.getNumBlocks()<<" blocks\n";
+      startScan();
     }
+    else
+      for (j=sorter.begin();j!=sorter.end();++j)
+      {
+	cout<<"Read file "<<baseName(j->second->getFileName())<<endl;
+	ta.hdr=j->second;
+	ta.opcode=ACT_READ;
+	enqueueAction(ta);
+      }
   }
   delete fileDialog;
   fileDialog=nullptr;
@@ -543,6 +552,8 @@ void WolkenCanvas::startProcessAsIs()
 
 void WolkenCanvas::startScan()
 {
+  if (keepStore && !resumed)
+    octStore.save(sources);
   waitForThreads(TH_SCAN);
   cout<<"Starting scan\n";
   octStore.shrink(); // This is where the GUI freezes.
@@ -569,6 +580,9 @@ void WolkenCanvas::startCount()
   int i;
   ThreadAction ta;
   waitForThreads(TH_PAUSE);
+  // Save again, since classifying changed the blocks and unsaved the store.
+  if (keepStore)
+    octStore.save(sources);
   cout<<"Counting points\n";
   classTotals.clear();
   octStore.setIgnoreDupes(false);
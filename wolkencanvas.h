@@ -41,6 +41,7 @@ public:
   QPointF worldToWindow(xy pnt);
   xy windowToWorld(QPointF pnt);
   double tileSize;
+  bool keepStore; // Save the octree store and reuse it for the same files.
   std::deque<LasHeader> inFileHeaders;
   int state;
 signals:
@@ -79,6 +80,7 @@ private:
   Cube cube; // sized to files, not octree
   xy windowCenter,worldCenter;
   std::string saveFileName;
+  std::vector<std::string> sources; // input files and point counts, to check a saved store
   double scale;
   double lengthUnit;
   double maxScaleSize,scaleSize;
@@ -86,6 +88,7 @@ private:
   xy leftScaleEnd,rightScaleEnd,scaleEnd;
   bool shallClassify; // false to split an already classified file
   bool saveLaz;
+  bool resumed; // The octree store was reopened instead of read from the files.
   int penPos;
   int fileCountdown;
   int lastOpcount;
@@ -93,7 +96,6 @@ private:
   int lastntri;
   int pixelsToPaint;
   int splashScreenTime; // in ticks
-  unsigned int countedBlock;
   std::vector<int> fileHitTest(xy pnt);
   std::array<double,3> pixelColorRead(int x,int y);
   std::array<double,3> pixelColorTile(Eisenstein tileAddr);
@@ -36,6 +36,7 @@
 #include "ldecimal.h"
 #include "brevno.h"
 #include "octree.h"
+#include "bulkload.h"
 #include "freeram.h"
 using namespace std;
 namespace po=boost::program_options;
@@ -45,14 +46,17 @@ int main(int argc,char **argv)
   LasPoint lPoint;
   int i;
   int nthreads=thread::hardware_concurrency();
+  double dirtyLow=DIRTY_LOW,dirtyHigh=DIRTY_HIGH,ramTierMiB=-1;
+  string evictStr;
   size_t j;
-  vector<string> inputFiles;
+  vector<string> inputFiles,sources;
+  ThreadAction ta;
   vector<LasHeader> files;
   vector<xyz> limits;
   xyz center;
   ofstream testFile("testfile");
   ofstream dumpFile("dumpfile");
-  bool validArgs,validCmd=true;
+  bool validArgs,validCmd=true,keep=false,reuse=false,resumed=false,bulk=false;
   po::options_description generic("Options");
   po::options_description hidden("Hidden options");
   po::options_description cmdline_options;
@@ -60,6 +64,14 @@ int main(int argc,char **argv)
   po::variables_map vm;
   if (nthreads<2)
     nthreads=2;
+  generic.add_options()
+    ("dirty-high",po::value<double>(&dirtyHigh),"Fraction of buffers dirty at which to start writing them")
+    ("dirty-low",po::value<double>(&dirtyLow),"Fraction of buffers dirty at which to stop writing them")
+    ("evict",po::value<string>(&evictStr),"Buffer replacement policy: clock or lru")
+    ("ram-tier",po::value<double>(&ramTierMiB),"MiB of evicted blocks to keep compressed in RAM")
+    ("keep",po::bool_switch(&keep),"Save the octree store for a later run")
+    ("reuse",po::bool_switch(&reuse),"Reuse the saved octree store if made from the same files")
+    ("bulk",po::bool_switch(&bulk),"Sort the points and build the octree in one pass");
   hidden.add_options()
     ("input",po::value<vector<string> >(&inputFiles),"Input file");
   p.add("input",-1);
@@ -74,9 +86,16 @@ int main(int argc,char **argv)
     cerr<<e.what()<<endl;
     validCmd=false;
   }
+#ifdef LASzip_FOUND
+  laszipInit();
+#endif
   files.resize(inputFiles.size());
   for (i=0;i<inputFiles.size();i++)
+  {
     files[i].openRead(inputFiles[i]);
+    octStore.addScaling(files[i].getScaling());
+    sources.push_back(files[i].fingerprint());
+  }
   for (i=0;i<files.size();i++)
   {
     int ver;
@@ -88,39 +107,51 @@ int main(int argc,char **argv)
   }
   lowRam=freeRam()/7;
   octRoot.sizeFit(limits);
-  center=octRoot.getCenter();
-  cout<<'('<<ldecimal(center.getx())<<','<<ldecimal(center.gety())<<','<<ldecimal(center.getz())<<")±";
-  cout<<octRoot.getSide()<<endl;
   lPoint.location=xyz(M_PI,exp(1),sqrt(2));
   for (i=0;i<RECORDS;i++)
     lPoint.write(testFile);
   if (nthreads<1)
     nthreads=1;
-  octStore.open("store.oct",nthreads+relprime(nthreads));
+  octStore.setDirtyMarks(dirtyLow,dirtyHigh);
+  if (ramTierMiB>=0)
+    octStore.setRamTier(ramTierMiB*1048576);
+  if (evictStr=="lru")
+    octStore.setEvictPolicy(EVICT_LRU);
+  else if (evictStr.length() && evictStr!="clock")
+    cerr<<"Unknown replacement policy "<<evictStr<<", using clock\n";
+  octStore.open("store.oct",nthreads+relprime(nthreads),STORE_DEFAULT,reuse);
   octStore.resize(8*nthreads+1);
+  if (reuse)
+    resumed=octStore.resume(sources);
+  if (resumed)
+    cout<<"Reusing store with "<<octStore.getNumBlocks()<<" blocks\n";
+  center=octRoot.getCenter();
+  cout<<'('<<ldecimal(center.getx())<<','<<ldecimal(center.gety())<<','<<ldecimal(center.getz())<<")±";
+  cout<<octRoot.getSide()<<endl;
   startThreads(nthreads);
   waitForThreads(TH_READ);
-  for (i=0;i<files.size();i++)
+  if (bulk && !resumed)
+  {
+    BulkLoader loader("store.octr",nthreads);
+    for (i=0;i<files.size();i++)
+      cout<<loader.addFile(files[i])<<" points\n";
+    cout<<"Building octree\n";
+    loader.build();
+  }
+  // The worker threads read the files, each file in ranges read at once.
+  for (i=0;i<files.size() && !resumed && !bulk;i++)
   {
-    for (j=0;j<files[i].numberPoints();j++)
-    {
-      lPoint=files[i].readPoint(j);
-      embufferPoint(lPoint,true);
-      if (j%987==0)
-      {
-	cout<<j<<"    \r";
-	cout.flush();
-	writeBufLog();
-      }
-    }
-    cout<<files[i].numberPoints()<<" points, "<<pointBufferSize()<<" points in buffer\n";
-    cout<<octStore.getNumBuffers()<<" buffers, "<<octStore.getNumBlocks()<<" blocks\n";
+    ta.hdr=&files[i];
+    ta.opcode=ACT_READ;
+    enqueueAction(ta);
   }
   waitForQueueEmpty();
   cout<<"All points in octree\n";
   cout<<alreadyInOctree.size()<<" duplicate points\n";
   cout<<octStore.getNumBuffers()<<" buffers, "<<octStore.getNumBlocks()<<" blocks\n";
   waitForThreads(TH_STOP);
+  if (keep && !resumed)
+    octStore.save(sources);
   cout<<"Dumping octree\n";
   octStore.dump(dumpFile);
   joinThreads();
@@ -31,9 +31,12 @@
 #include <cstring>
 #include <vector>
 #include <string>
+#include <map>
 #include "config.h"
 #include "angle.h"
 #include "octree.h"
+#include "las.h"
+#include "bulkload.h"
 #include "shape.h"
 #include "testpattern.h"
 #include "eisenstein.h"
@@ -741,6 +744,29 @@ void testldecimal()
   tassert(ldecimal(-64664./65536,1./131072)=="-.9867");
 }
 
+void testquantize()
+/* Checks that points read from a LAS file round-trip exactly through
+ * the integers that quantized blocks store, and that points that aren't
+ * on the grid are refused, so that their blocks are stored as doubles.
+ */
+{
+  LasScaling sc(486913.25,3948712.5,312.125,0.001,0.001,0.0025,1200/3937.);
+  int32_t q[3];
+  int i,nexact=0;
+  xyz pnt;
+  for (i=0;i<1000;i++)
+  {
+    pnt=sc.unquantize(rng.uirandom(),rng.uirandom(),rng.uirandom());
+    if (sc.quantize(pnt,q) && sc.unquantize(q[0],q[1],q[2])==pnt)
+      nexact++;
+  }
+  cout<<nexact<<" of 1000 points quantized exactly\n";
+  tassert(nexact==1000);
+  tassert(!sc.quantize(xyz(M_PI,0,0),q));
+  tassert(!sc.quantize(xyz(1e20,0,0),q));
+  tassert(sc==LasScaling(486913.25,3948712.5,312.125,0.001,0.001,0.0025,1200/3937.));
+}
+
 void testleastsquares()
 {
   matrix a(3,2);
@@ -1029,6 +1055,792 @@ void testbigcloud()
   }
 }
 
+double benchEvict(int policy,int nthreads)
+/* Each thread uses buffers at random, and every 64th time looks for
+ * a buffer to reuse, as getBlock would on a miss. Returns the number
+ * of operations per second.
+ */
+{
+  const int nbuf=4096,nops=262144;
+  LruEvictor lru;
+  ClockEvictor clock;
+  vector<thread> th;
+  int i;
+  chrono::duration<double> elapsed;
+  lru.resize(nbuf);
+  clock.resize(nbuf);
+  auto start=chrono::steady_clock::now();
+  for (i=0;i<nthreads;i++)
+    th.push_back(thread([&,i]()
+    {
+      uint32_t x=i*2654435761u+1;
+      int j,buf;
+      auto usable=[](int b){return b%7!=0;}; // pretend every 7th is owned
+      for (j=0;j<nops;j++)
+      {
+	x=x*1103515245+12345;
+	buf=(x>>8)%nbuf;
+	if (j%64)
+	  if (policy==EVICT_CLOCK)
+	    clock.touch(buf);
+	  else
+	    lru.touch(buf);
+	else
+	  if (policy==EVICT_CLOCK)
+	    clock.victim(i,usable);
+	  else
+	    lru.victim(usable);
+      }
+    }));
+  for (i=0;i<nthreads;i++)
+    th[i].join();
+  elapsed=chrono::steady_clock::now()-start;
+  return (double)nops*nthreads/elapsed.count();
+}
+
+int keyDepth(uint64_t key)
+{
+  int d;
+  for (d=0;d<MORTON_BITS && key>>3*(d+1);d++);
+  return d;
+}
+
+uintptr_t descendModel(map<uint64_t,uintptr_t> &model,xyz pnt,xyz center,double side,uint64_t &key,Cube &cube)
+/* Finds pnt in a model of an octree, with the comparisons Octree makes.
+ * model maps keys to the words in Octree::sub; 2 stands for an Octree *.
+ * Keys don't go below depth MORTON_BITS, so a node there with word 2
+ * stands for nodes too deep for the index.
+ */
+{
+  int d=0,xbit,ybit,zbit;
+  uintptr_t w;
+  key=1;
+  do
+  {
+    d++;
+    xbit=pnt.getx()>=center.getx();
+    ybit=pnt.gety()>=center.gety();
+    zbit=pnt.getz()>=center.getz();
+    key=key<<3|zbit*4|ybit*2|xbit;
+    side/=2;
+    center=xyz(center.getx()+(2*xbit-1)*side/2,center.gety()+(2*ybit-1)*side/2,center.getz()+(2*zbit-1)*side/2);
+    w=model.count(key)?model[key]:0;
+  } while (w && !(w&1) && d<MORTON_BITS);
+  cube=Cube(center,side);
+  return w;
+}
+
+void setModel(map<uint64_t,uintptr_t> &model,MortonIndex &index,uint64_t key,uintptr_t word)
+// Like Octree, leaves nodes deeper than MORTON_BITS out of the index.
+{
+  model[key]=word;
+  if (keyDepth(key)<=MORTON_BITS)
+    index.set(key,word);
+}
+
+void splitModel(map<uint64_t,uintptr_t> &model,MortonIndex &index,uint64_t key,int64_t &nblocks)
+{
+  int i;
+  setModel(model,index,key,2);
+  for (i=0;i<8;i++)
+    if (rng.ucrandom()&1)
+      setModel(model,index,key<<3|i,2*nblocks++ +1);
+}
+
+double randomCoord(double lo,double side)
+{
+  return lo+ldexp(side*rng.uirandom(),-32);
+}
+
+void testmortonindex()
+/* Checks spreadBits and compactBits, then checks that MortonIndex::find
+ * finds the same block and cube as descending a random tree, for points
+ * anywhere, on faces of nodes, near a chain of nodes deeper than the index
+ * goes, and outside the root.
+ */
+{
+  MortonIndex index;
+  map<uint64_t,uintptr_t> model;
+  xyz center(1000,2000,300),pnt;
+  double side=1024,lo[3]={488,1488,-212},coord[3];
+  Cube cube,modelCube;
+  uint64_t x,key;
+  uintptr_t word,modelWord;
+  int64_t nblocks=0;
+  int i,j,k,nInside=0,nFound=0,nOutside=0,nWrong=0;
+  bool outside;
+  for (i=0;i<1000;i++)
+  {
+    x=rng.uirandom()&0x1fffff;
+    tassert(compactBits(spreadBits(x))==x);
+    tassert((spreadBits(x)&~0x1249249249249249ULL)==0);
+    for (j=0;j<21;j++)
+      tassert(((spreadBits(x)>>3*j)&1)==((x>>j)&1));
+  }
+  index.setCube(center,side);
+  for (i=0;i<3000;i++)
+  {
+    pnt=xyz(randomCoord(lo[0],side),randomCoord(lo[1],side),randomCoord(lo[2],side));
+    modelWord=descendModel(model,pnt,center,side,key,modelCube);
+    if (modelWord==0)
+      setModel(model,index,key,2*nblocks++ +1);
+    else if (keyDepth(key)<10 && rng.ucrandom()<128)
+      splitModel(model,index,key,nblocks);
+  }
+  pnt=xyz(randomCoord(lo[0],side),randomCoord(lo[1],side),randomCoord(lo[2],side));
+  while (descendModel(model,pnt,center,side,key,modelCube),keyDepth(key)<MORTON_BITS)
+    splitModel(model,index,key,nblocks);
+  setModel(model,index,key,2);
+  cout<<model.size()<<" nodes in model tree\n";
+  for (i=0;i<100000;i++)
+  {
+    for (j=0;j<3;j++)
+      coord[j]=randomCoord(lo[j],side);
+    if (i%4==1) // on a face of a node at depth k
+      for (j=0;j<3;j++)
+      {
+	k=rng.ucrandom()%12+1;
+	coord[j]=lo[j]+rint((coord[j]-lo[j])/ldexp(side,-k))*ldexp(side,-k);
+      }
+    if (i%4==2) // near the deep chain
+      for (j=0;j<3;j++)
+	coord[j]=modelCube.getCenter().getx()*(j==0)+modelCube.getCenter().gety()*(j==1)+
+		 modelCube.getCenter().getz()*(j==2)+(rng.ucrandom()-128)*ldexp(side,-MORTON_BITS-3);
+    outside=false;
+    if (i%16==3)
+    {
+      j=rng.ucrandom()%3;
+      coord[j]=(rng.ucrandom()&1)?lo[j]-randomCoord(0,side):lo[j]+side+randomCoord(0,side);
+      outside=true;
+    }
+    if (i%16==7) // exactly on the far face of the root, which is outside it
+    {
+      coord[rng.ucrandom()%3]+=side;
+      for (j=0;j<3;j++)
+	if (coord[j]>=lo[j]+side)
+	  coord[j]=lo[j]+side;
+      outside=true;
+    }
+    pnt=xyz(coord[0],coord[1],coord[2]);
+    if (outside)
+    {
+      nOutside++;
+      if (index.find(pnt,word,cube))
+	nWrong++;
+      continue;
+    }
+    nInside++;
+    if (index.find(pnt,word,cube))
+    {
+      nFound++;
+      modelWord=descendModel(model,pnt,center,side,key,modelCube);
+      if (word!=modelWord || modelWord==2 || !(cube.getCenter()==modelCube.getCenter()) || cube.getSide()!=modelCube.getSide())
+	nWrong++;
+    }
+  }
+  cout<<nFound<<" of "<<nInside<<" points inside the root found in the index, ";
+  cout<<nOutside<<" outside, "<<nWrong<<" wrong\n";
+  tassert(nWrong==0);
+  tassert(nFound>nInside/2);
+}
+
+bool sameLasPoint(const LasPoint &a,const LasPoint &b)
+{
+  bool ret=a.location==b.location && a.intensity==b.intensity &&
+	   a.returnNum==b.returnNum && a.nReturns==b.nReturns &&
+	   a.scanDirection==b.scanDirection && a.edgeLine==b.edgeLine &&
+	   a.classification==b.classification && a.classificationFlags==b.classificationFlags &&
+	   a.scannerChannel==b.scannerChannel && a.userData==b.userData &&
+	   a.pointSource==b.pointSource && a.scanAngle==b.scanAngle && a.gpsTime==b.gpsTime &&
+	   a.nir==b.nir && a.red==b.red && a.green==b.green && a.blue==b.blue;
+#ifdef WAVEFORM
+  ret=ret && a.waveIndex==b.waveIndex && a.waveformOffset==b.waveformOffset &&
+      a.waveformSize==b.waveformSize && a.waveformTime==b.waveformTime &&
+      a.xDir==b.xDir && a.yDir==b.yDir && a.zDir==b.zDir;
+#endif
+  return ret;
+}
+
+void testlasformats()
+/* Writes points in each format with writePoint, reads them back with
+ * readPoints in pieces that don't line up with LAS_BATCH, and with a
+ * PointReader, and checks that every field the format has comes back
+ * and every other field is left at its default.
+ */
+{
+  LasHeader out,in;
+  LasScaling sc;
+  vector<LasPoint> written,pnts;
+  LasPoint pnt;
+  int f,i,nbad;
+  size_t start,n;
+  const int npoints=LAS_BATCH+1000;
+  string fileName;
+  for (f=0;f<11;f++)
+  {
+    fileName="format"+to_string(f)+".las";
+    written.clear();
+    out.openWrite(fileName,SI_TEST);
+    out.setVersion(1,4);
+    out.setPointFormat(f);
+    out.setScale(xyz(-500,-500,-50),xyz(500,500,50),xyz(0.001,0.001,0.00025));
+    sc=out.getScaling();
+    for (i=0;i<npoints;i++)
+    {
+      pnt=LasPoint();
+      pnt.location=sc.unquantize(rng.uirandom()%1000000-500000,rng.uirandom()%1000000-500000,
+				 rng.uirandom()%400000-200000);
+      pnt.intensity=rng.usrandom();
+      pnt.scanDirection=rng.ucrandom()&1;
+      pnt.edgeLine=rng.ucrandom()&1;
+      pnt.userData=rng.ucrandom();
+      pnt.pointSource=rng.usrandom();
+      if (f<6)
+      {
+	pnt.nReturns=rng.ucrandom()%5+1; // the header counts only five returns
+	pnt.returnNum=rng.ucrandom()%pnt.nReturns+1;
+	pnt.classification=rng.ucrandom()&31;
+	pnt.classificationFlags=rng.ucrandom()&7;
+	pnt.scanAngle=degtobin(rng.ucrandom()%181-90);
+      }
+      else
+      {
+	pnt.nReturns=rng.ucrandom()%15+1;
+	pnt.returnNum=rng.ucrandom()%pnt.nReturns+1;
+	pnt.classification=rng.ucrandom();
+	pnt.classificationFlags=rng.ucrandom()&15;
+	pnt.scannerChannel=rng.ucrandom()&3;
+	pnt.scanAngle=degtobin((rng.usrandom()%30001-15000)*0.006);
+      }
+      if ((1<<f)&MASK_GPSTIME)
+	pnt.gpsTime=rng.uirandom()/1024.;
+      if ((1<<f)&MASK_RGB)
+      {
+	pnt.red=rng.usrandom();
+	pnt.green=rng.usrandom();
+	pnt.blue=rng.usrandom();
+      }
+      if ((1<<f)&MASK_NIR)
+	pnt.nir=rng.usrandom();
+#ifdef WAVEFORM
+      if ((1<<f)&MASK_WAVE)
+      {
+	pnt.waveIndex=rng.ucrandom();
+	pnt.waveformOffset=(size_t)rng.uirandom()<<16;
+	pnt.waveformSize=rng.uirandom();
+	pnt.waveformTime=rng.usrandom()/64.;
+	pnt.xDir=rng.usrandom()/65536.;
+	pnt.yDir=rng.usrandom()/65536.;
+	pnt.zDir=rng.usrandom()/65536.;
+      }
+#endif
+      out.writePoint(pnt);
+      written.push_back(pnt);
+    }
+    out.writeHeader();
+    out.close();
+    in.openRead(fileName);
+    tassert(in.getPointFormat()==f);
+    tassert(in.numberPoints()==npoints);
+    nbad=0;
+    for (start=0;start<npoints;start+=n)
+    {
+      pnts.clear();
+      n=in.readPoints(start,999,pnts);
+      if (n==0)
+	break;
+      for (i=0;i<n;i++)
+	nbad+=!sameLasPoint(pnts[i],written[start+i]);
+    }
+    tassert(start==npoints);
+    {
+      PointReader reader(in);
+      pnts.clear();
+      n=reader.readPoints(0,npoints,pnts);
+      tassert(n==npoints);
+      for (i=0;i<n;i++)
+	nbad+=!sameLasPoint(pnts[i],written[i]);
+    }
+    in.close();
+    cout<<"Format "<<f<<": "<<nbad<<" points read wrong\n";
+    tassert(nbad==0);
+  }
+  /* Insert the start of a LASzip record after the header of a file, so
+   * that it looks compressed but can't be decompressed. Reading points
+   * must throw, not return the bytes as points.
+   */
+  ifstream lasIn("format0.las",ios::binary);
+  string contents((istreambuf_iterator<char>(lasIn)),istreambuf_iterator<char>());
+  int headerSize=(unsigned char)contents[94]|(unsigned char)contents[95]<<8;
+  uint32_t pointOffset=0;
+  for (i=3;i>=0;i--)
+    pointOffset=pointOffset<<8|(unsigned char)contents[96+i];
+  pointOffset+=8;
+  for (i=0;i<4;i++)
+    contents[96+i]=pointOffset>>(8*i);
+  contents.insert(headerSize,string("\0\0laszip",8));
+  ofstream lazOut("fakezip.laz",ios::binary);
+  lazOut<<contents;
+  lazOut.close();
+  in.openRead("fakezip.laz");
+  tassert(in.isZipped());
+  nbad=0;
+  try
+  {
+    pnts.clear();
+    in.readPoints(0,999,pnts);
+  }
+  catch (...)
+  {
+    nbad++;
+  }
+  try
+  {
+    PointReader reader(in);
+  }
+  catch (...)
+  {
+    nbad++;
+  }
+  in.close();
+  tassert(nbad==2);
+}
+
+void testbulkload()
+/* Bulk-loads a file of points that are all in different places and, if
+ * compiled with LASzip, the same file compressed, which is read through
+ * LASzip. Checks that every point of each file is read and that each
+ * point is in the octree once.
+ */
+{
+  LasHeader out,in;
+  LasScaling sc;
+  LasPoint pnt;
+  vector<xyz> limits;
+  map<int,size_t> classes;
+  map<int,size_t>::iterator j;
+  size_t i,nstored=0,dupes=alreadyInOctree.size();
+  int64_t b;
+  const size_t npoints=5000;
+  out.openWrite("bulk.las",SI_TEST);
+  out.setVersion(1,4);
+  out.setPointFormat(6);
+  out.setScale(xyz(0,0,0),xyz(100,100,10),xyz(0.001,0.001,0.001));
+  sc=out.getScaling();
+  for (i=0;i<npoints;i++)
+  {
+    pnt=LasPoint();
+    pnt.location=sc.unquantize(i%100*997,i/100*991,rng.usrandom()%10000);
+    pnt.returnNum=pnt.nReturns=1;
+    pnt.classification=i%7;
+    pnt.gpsTime=i;
+    out.writePoint(pnt);
+  }
+  out.writeHeader();
+  out.close();
+#ifdef LASzip_FOUND
+  laszipInit();
+  laszipCompex("bulk.las","bulk.laz",true);
+#endif
+  in.openRead("bulk.las");
+  limits.push_back(in.minCorner());
+  limits.push_back(in.maxCorner());
+  octRoot.sizeFit(limits);
+  {
+    BulkLoader loader("bulk.octr",1);
+    tassert(loader.addFile(in)==npoints);
+#ifdef LASzip_FOUND
+    in.openRead("bulk.laz");
+    tassert(in.isZipped());
+    tassert(loader.addFile(in)==npoints);
+#endif
+    loader.build();
+  }
+  for (b=0;b<octStore.getNumBlocks();b++)
+  {
+    classes=octStore.countClasses(b);
+    octStore.disown();
+    for (j=classes.begin();j!=classes.end();++j)
+      nstored+=j->second;
+  }
+  cout<<nstored<<" of "<<npoints<<" points stored, ";
+  cout<<alreadyInOctree.size()-dupes<<" duplicates\n";
+  tassert(nstored==npoints);
+#ifdef LASzip_FOUND
+  tassert(alreadyInOctree.size()-dupes==npoints);
+#endif
+}
+
+void fillTestStore(vector<LasPoint> &pnts)
+/* Puts points in an empty store, all in different places, on a grid
+ * that is quantizable.
+ */
+{
+  LasScaling sc(0,0,0,0.001,0.001,0.001,1);
+  vector<xyz> limits;
+  LasPoint pnt;
+  int i;
+  octStore.addScaling(sc);
+  limits.push_back(xyz(0,0,0));
+  limits.push_back(xyz(100,100,10));
+  octRoot.sizeFit(limits);
+  pnts.clear();
+  for (i=0;i<5000;i++)
+  {
+    pnt=LasPoint();
+    pnt.location=sc.unquantize(i%100*997+rng.usrandom()%997,i/100*1999+rng.usrandom()%997,rng.usrandom()%10000);
+    pnt.returnNum=pnt.nReturns=1;
+    pnt.classification=i%7;
+    pnt.gpsTime=i;
+    octStore.put(pnt);
+    octStore.disown();
+    pnts.push_back(pnt);
+  }
+}
+
+void makeTestStore(string name,vector<LasPoint> &pnts)
+{
+  octStore.clearBlocks();
+  octRoot.clear();
+  octStore.clear();
+  octStore.open(name);
+  fillTestStore(pnts);
+}
+
+int countWrongPoints(const vector<LasPoint> &pnts)
+{
+  int i,ret=0;
+  LasPoint pnt;
+  for (i=0;i<pnts.size();i++)
+  {
+    pnt=octStore.get(pnts[i].location);
+    octStore.disown();
+    ret+=!sameLasPoint(pnt,pnts[i]);
+  }
+  return ret;
+}
+
+bool earlierGpsTime(const LasPoint &a,const LasPoint &b)
+{
+  return a.gpsTime<b.gpsTime;
+}
+
+vector<LasPoint> blockPoints(int n,xyz center,const LasScaling &sc0,const LasScaling &sc1,double time)
+/* Makes n points around center, on a grid in sc0, or alternately in sc0
+ * and sc1 if they differ, with the other fields random but quantizable.
+ */
+{
+  vector<LasPoint> pnts;
+  LasPoint pnt;
+  int32_t q[3];
+  int i,spacing;
+  bool odd;
+  for (i=0;i<n;i++)
+  {
+    odd=(i&1) && !(sc0==sc1);
+    const LasScaling &sc=odd?sc1:sc0;
+    spacing=odd?17:50;
+    sc.quantize(center,q);
+    pnt=LasPoint();
+    pnt.location=sc.unquantize(q[0]+i%10*spacing,q[1]+i/10%10*spacing,q[2]+i/100*spacing);
+    pnt.intensity=rng.usrandom();
+    pnt.nReturns=rng.ucrandom()%15+1;
+    pnt.returnNum=rng.ucrandom()%pnt.nReturns+1;
+    pnt.classification=rng.ucrandom();
+    pnt.classificationFlags=rng.ucrandom()&15;
+    pnt.scannerChannel=rng.ucrandom()&3;
+    pnt.scanDirection=rng.ucrandom()&1;
+    pnt.edgeLine=rng.ucrandom()&1;
+    pnt.userData=rng.ucrandom();
+    pnt.scanAngle=degtobin((rng.usrandom()%30001-15000)*0.006);
+    pnt.pointSource=rng.usrandom();
+    pnt.gpsTime=time+i;
+    pnt.red=rng.usrandom();
+    pnt.green=rng.usrandom();
+    pnt.blue=rng.usrandom();
+    pnt.nir=rng.usrandom();
+    pnts.push_back(pnt);
+  }
+  return pnts;
+}
+
+void countEncodings(string fileName,int size,int &nQuant,int &nDouble)
+// Counts the blocks in a store file by the encoding in their last byte.
+{
+  ifstream file(fileName,ios::binary);
+  vector<char> block(size);
+  nQuant=nDouble=0;
+  while (file.read(&block[0],size))
+  {
+    nQuant+=block[size-1]==BLOCK_QUANT;
+    nDouble+=block[size-1]==BLOCK_DOUBLE;
+  }
+}
+
+void testblockformats()
+/* Makes full and small blocks of points in one scaling, which are stored
+ * quantized, and of points in two scalings, which must fall back to
+ * doubles. Saves and resumes the store, so that the blocks are read back
+ * from the files, and checks the encodings and every point.
+ */
+{
+  LasScaling sc0(0,0,0,0.001,0.001,0.001,1),sc1(0.0005,0.0005,0.0005,0.003,0.003,0.003,1);
+  vector<string> sources;
+  vector<LasPoint> pnts,written[4],got;
+  vector<xyz> limits;
+  int64_t blk[4];
+  int i,j,nbad=0,nQuant,nDouble;
+  int sizes[4]={QRECORDS,RECORDS,(SMALL_BLOCKSIZE-1-QUANT_HEADER_SIZE)/QPOINT_SIZE,
+		(SMALL_BLOCKSIZE-1)/LASPOINT_SIZE};
+  sources.push_back("block format test");
+  octStore.clearBlocks();
+  octRoot.clear();
+  octStore.clear();
+  octStore.open("blocks.oct");
+  tassert(octStore.addScaling(sc0)==0);
+  tassert(octStore.addScaling(sc1)==1);
+  limits.push_back(xyz(0,0,0));
+  limits.push_back(xyz(100,100,100));
+  octRoot.sizeFit(limits);
+  // The quantized blocks are 0 and 2, the mixed ones 1 and 3.
+  tassert(!octStore.fitsBlock(blockPoints(QRECORDS+1,octRoot.cube(0).getCenter(),sc0,sc0,0)));
+  tassert(!octStore.fitsBlock(blockPoints(RECORDS+1,octRoot.cube(1).getCenter(),sc0,sc1,0)));
+  for (i=0;i<4;i++)
+  {
+    written[i]=blockPoints(sizes[i],octRoot.cube(i).getCenter(),sc0,(i&1)?sc1:sc0,i*1000);
+    tassert(octStore.fitsBlock(written[i]));
+    pnts=written[i];
+    blk[i]=octStore.newLeaf(octRoot.cube(i).getCenter(),1,pnts);
+  }
+  octStore.save(sources);
+  tassert(octStore.resume(sources));
+  countEncodings("blocks.oct0",BLOCKSIZE,nQuant,nDouble);
+  tassert(nQuant==1 && nDouble==1);
+  countEncodings("blocks.octs0",SMALL_BLOCKSIZE,nQuant,nDouble);
+  tassert(nQuant==1 && nDouble==1);
+  for (i=0;i<4;i++)
+  {
+    got=octStore.getAll(blk[i]);
+    sort(got.begin(),got.end(),earlierGpsTime);
+    tassert(got.size()==written[i].size());
+    for (j=0;j<got.size() && j<written[i].size();j++)
+      nbad+=!sameLasPoint(got[j],written[i][j]);
+  }
+  cout<<nbad<<" points read wrong\n";
+  tassert(nbad==0);
+}
+
+vector<LasPoint> allStoredPoints()
+// Reads every point in every leaf block.
+{
+  vector<LasPoint> ret,pnts;
+  vector<int64_t> blocks;
+  int i;
+  blocks=octRoot.findBlocks(Cylinder(xy(octRoot.getCenter()),octRoot.getSide()));
+  for (i=0;i<blocks.size();i++)
+  {
+    pnts=octStore.getAll(blocks[i]);
+    octStore.disown();
+    ret.insert(ret.end(),pnts.begin(),pnts.end());
+  }
+  return ret;
+}
+
+int checkAggregates(int nShapes)
+/* Compares the totals kept in the octree with a pass over the points in
+ * the blocks: the root's count and class counts, and the count and
+ * elevation range in random cylinders. Checks that a sample contains only
+ * points in the store with their current classes. Returns the number of
+ * totals that don't match.
+ */
+{
+  vector<LasPoint> all,sample;
+  uint64_t classes[NODE_CLASSES];
+  uint64_t count;
+  array<double,2> hiLo;
+  double hi,lo,radius;
+  xy center;
+  LasPoint pnt;
+  int i,j,nbad=0;
+  all=allStoredPoints();
+  for (i=0;i<NODE_CLASSES;i++)
+    classes[i]=0;
+  for (i=0;i<all.size();i++)
+    classes[min((int)all[i].classification,NODE_CLASSES-1)]++;
+  nbad+=octRoot.getStats().getCount()!=all.size();
+  for (i=0;i<NODE_CLASSES;i++)
+    nbad+=octRoot.getStats().getClass(i)!=classes[i];
+  for (i=0;i<nShapes;i++)
+  {
+    radius=i?rng.usrandom()/1000.:octRoot.getSide(); // The first covers the whole cloud.
+    center=xy(octRoot.getCenter())+xy(rng.usrandom()/655.36-50,rng.usrandom()/655.36-50);
+    Cylinder cyl(center,radius);
+    count=0;
+    hi=-INFINITY;
+    lo=INFINITY;
+    for (j=0;j<all.size();j++)
+      if (cyl.in(all[j].location))
+      {
+	count++;
+	if (all[j].location.elev()>hi)
+	  hi=all[j].location.elev();
+	if (all[j].location.elev()<lo)
+	  lo=all[j].location.elev();
+      }
+    nbad+=octStore.countPointsIn(cyl)!=count;
+    octStore.disown();
+    hiLo=octStore.hiLoPointsIn(cyl);
+    octStore.disown();
+    nbad+=hiLo[0]!=lo || hiLo[1]!=hi;
+    sample=octStore.samplePointsIn(cyl,0);
+    octStore.disown();
+    nbad+=sample.size()!=count;
+    sample=octStore.samplePointsIn(cyl,1);
+    octStore.disown();
+    nbad+=sample.size()>count || (count>0)!=(sample.size()>0);
+    for (j=0;j<sample.size();j++)
+    {
+      pnt=octStore.get(sample[j].location);
+      octStore.disown();
+      nbad+=!cyl.in(sample[j].location) || !sameLasPoint(pnt,sample[j]);
+    }
+  }
+  return nbad;
+}
+
+void testaggregates()
+/* Checks the octree's totals after putting points, which splits blocks,
+ * after changing the classes of points in place, and after putting more
+ * points among those whose classes were changed.
+ */
+{
+  vector<LasPoint> pnts;
+  LasPoint pnt;
+  int i,nbad;
+  size_t nBlocks;
+  makeTestStore("aggregates.oct",pnts);
+  tassert(octStore.getNumBlocks()>1);
+  nbad=checkAggregates(30);
+  cout<<nbad<<" totals wrong after putting\n";
+  tassert(nbad==0);
+  octStore.setIgnoreDupes(true);
+  for (i=0;i<pnts.size();i+=3)
+  {
+    pnts[i].classification=rng.ucrandom()%40; // some above NODE_CLASSES
+    octStore.put(pnts[i]);
+    octStore.disown();
+  }
+  octStore.setIgnoreDupes(false);
+  nbad=checkAggregates(30);
+  cout<<nbad<<" totals wrong after changing classes\n";
+  tassert(nbad==0);
+  nBlocks=octStore.getNumBlocks();
+  for (i=0;i<3000;i++)
+  {
+    pnt=pnts[i];
+    pnt.location=xyz(pnt.location.getx(),pnt.location.gety(),pnt.location.getz()+10);
+    pnt.classification=rng.ucrandom()%40;
+    octStore.put(pnt);
+    octStore.disown();
+  }
+  tassert(octStore.getNumBlocks()>nBlocks);
+  nbad=checkAggregates(30);
+  cout<<nbad<<" totals wrong after splitting\n";
+  tassert(nbad==0);
+}
+
+void testresume()
+/* Saves a store and resumes it, then checks that changing a point in
+ * place, which leaves its block in the same slot, removes the index.
+ */
+{
+  vector<string> sources;
+  vector<LasPoint> pnts;
+  sources.push_back("resume test");
+  makeTestStore("resume.oct",pnts);
+  octStore.save(sources);
+  tassert(ifstream("resume.octi").good());
+  tassert(octStore.resume(sources));
+  tassert(countWrongPoints(pnts)==0);
+  tassert(ifstream("resume.octi").good());
+  pnts[0].classification=2;
+  octStore.setIgnoreDupes(true);
+  octStore.put(pnts[0]);
+  octStore.disown();
+  octStore.setIgnoreDupes(false);
+  tassert(!ifstream("resume.octi").good());
+  tassert(!octStore.resume(sources));
+}
+
+int64_t fileSize(string name)
+{
+  ifstream file(name,ios::binary|ios::ate);
+  return file.is_open()?(int64_t)file.tellg():-1;
+}
+
+void testresumedamaged()
+/* Resumes from a truncated index, which should fail and leave an empty
+ * store, with no slots left from the damaged index, that can be filled.
+ */
+{
+  vector<string> sources;
+  vector<LasPoint> pnts;
+  string contents;
+  int64_t bigSize,smallSize;
+  int cut;
+  sources.push_back("resume test");
+  for (cut=1;cut<=2;cut++)
+  {
+    makeTestStore("resume.oct",pnts);
+    octStore.save(sources);
+    bigSize=fileSize("resume.oct0");
+    smallSize=fileSize("resume.octs0");
+    ifstream idxIn("resume.octi",ios::binary);
+    contents.assign(istreambuf_iterator<char>(idxIn),istreambuf_iterator<char>());
+    idxIn.close();
+    // Cut off the scalings, so that the slot table is read, or half of it.
+    ofstream idxOut("resume.octi",ios::binary|ios::trunc);
+    idxOut<<contents.substr(0,cut==1?contents.length()-4:contents.length()/2);
+    idxOut.close();
+    tassert(!octStore.resume(sources));
+    tassert(octStore.getNumBlocks()==0);
+    tassert(!ifstream("resume.octi").good());
+    fillTestStore(pnts);
+    octStore.flush();
+    tassert(countWrongPoints(pnts)==0);
+    tassert(fileSize("resume.oct0")<=bigSize*3/2+4*BLOCKSIZE);
+    tassert(fileSize("resume.octs0")<=smallSize*3/2+4*SMALL_BLOCKSIZE);
+  }
+}
+
+void testevict()
+/* Checks that the clock gives a second chance to used buffers.
+ */
+{
+  ClockEvictor clock;
+  int i,victim;
+  clock.resize(100);
+  for (i=0;i<100;i++)
+    if (i!=37)
+      clock.touch(i);
+  victim=clock.victim(37%CLOCK_SHARDS,[](int b){return true;});
+  cout<<"Clock victim "<<victim<<endl;
+  tassert(victim==37);
+}
+
+void testevictbench()
+/* Compares the speed of the two eviction policies with many threads.
+ * Not run by ctest, as it takes a while and only prints the speeds.
+ */
+{
+  int i;
+  for (i=8;i<=32;i*=2)
+  {
+    cout<<setw(2)<<i<<" threads: LRU "<<lrint(benchEvict(EVICT_LRU,i));
+    cout<<" clock "<<lrint(benchEvict(EVICT_CLOCK,i))<<" operations/s"<<endl;
+  }
+}
+
 void testwkt()
 {
   char wvawkt[]= // Well-known text from square of West Virginia terrain
@@ -1076,7 +1888,7 @@ int main(int argc, char *argv[])
     args.push_back(argv[i]);
   initPhases();
   fillTanTables();
-  startThreads(1); // so that lockCube doesn't divide by 0
+  startThreads(1); // so that embufferPoint doesn't divide by 0
   waitForThreads(TH_STOP);
   joinThreads();
   octStore.open("store.oct");
@@ -1110,6 +1922,8 @@ int main(int argc, char *argv[])
     testmanysum(); // >2 s
   if (shoulddo("ldecimal"))
     testldecimal();
+  if (shoulddo("quantize"))
+    testquantize();
   if (shoulddo("integertrig"))
     testintegertrig();
   if (shoulddo("leastsquares"))
@@ -1122,6 +1936,24 @@ int main(int argc, char *argv[])
     testsplitfile();
   if (shoulddo("bigcloud"))
     testbigcloud();
+  if (shoulddo("blockformats"))
+    testblockformats();
+  if (shoulddo("aggregates"))
+    testaggregates();
+  if (shoulddo("resume"))
+    testresume();
+  if (shoulddo("resumedamaged"))
+    testresumedamaged();
+  if (shoulddo("bulkload"))
+    testbulkload();
+  if (shoulddo("lasformats"))
+    testlasformats();
+  if (shoulddo("mortonindex"))
+    testmortonindex();
+  if (shoulddo("evict"))
+    testevict();
+  if (shoulddo("evictbench"))
+    testevictbench();
   if (shoulddo("wkt"))
     testwkt();
   cout<<"\nTest "<<(testfail?"failed":"passed")<<endl;